@@ -0,0 +1,282 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#endif
+
+#include "zstd/zstd.h"
+#include "seekable.h"
+#include "async-writer.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for compressing on a background thread.
+//
+// There are two buffers of equal size.  The R thread copies data into the
+// 'fill' buffer.  When it is full, the buffers are swapped and the worker
+// thread compresses the 'busy' buffer and writes the output, while the
+// R thread carries on filling the other buffer.
+//
+// If the worker is still busy when the 'fill' buffer is full again, the
+// R thread waits for it (back-pressure), so at most two buffers of data
+// are ever held in memory.
+//
+// The worker must not call any R API functions, so it can only be used
+// with a writer whose output callback is pure C (e.g. 'seekable_write_file()')
+// Errors from the worker are stored, and returned to the R thread by the
+// next call to 'async_writer_write()' or 'async_writer_finish()'.
+//
+// Usage:
+//   aw = async_writer_init(&writer, INSIZE);  // NULL if threads unavailable
+//   err = async_writer_write(aw, src, len);   // For each chunk of data
+//   err = async_writer_flush(aw);             // Optional. Write out all data so far
+//   err = async_writer_finish(aw);            // compress remaining data. Stop thread
+//   seekable_writer_end(&writer);             // on the R thread
+//   async_writer_free(aw);
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+#ifndef __EMSCRIPTEN__
+
+struct async_writer_s {
+  seekable_writer_t *writer;
+  size_t capacity;
+
+  unsigned char *fill;  // Being filled by the R thread
+  size_t fill_len;
+
+  unsigned char *busy;  // Being compressed by the worker
+  size_t busy_len;
+
+  int pending;          // Boolean: 'busy' has data which the worker has not finished with
+  int quit;             // Boolean: worker should exit once idle
+  int running;          // Boolean: worker thread has been started and not yet joined
+  size_t err;           // First zstd error code from the worker. 0 = no error
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Worker loop: compress each buffer handed over until told to quit.
+// This runs outside the main R thread.  No R API calls.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *async_worker(void *arg) {
+  async_writer_t *aw = (async_writer_t *)arg;
+
+  pthread_mutex_lock(&aw->mutex);
+  while (1) {
+    while (!aw->pending && !aw->quit) {
+      pthread_cond_wait(&aw->cond, &aw->mutex);
+    }
+    if (!aw->pending) break;
+
+    pthread_mutex_unlock(&aw->mutex);
+    size_t res = 0;
+    if (aw->err == 0) {
+      res = seekable_writer_compress(aw->writer, aw->busy, aw->busy_len);
+    }
+    pthread_mutex_lock(&aw->mutex);
+
+    if (ZSTD_isError(res) && aw->err == 0) {
+      aw->err = res;
+    }
+    aw->pending = 0;
+    pthread_cond_broadcast(&aw->cond);
+  }
+  pthread_mutex_unlock(&aw->mutex);
+
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Hand the 'fill' buffer to the worker.  Waits while the worker is busy.
+// @return 0 or a zstd error code from the worker
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t async_writer_submit(async_writer_t *aw) {
+  pthread_mutex_lock(&aw->mutex);
+  while (aw->pending) {
+    pthread_cond_wait(&aw->cond, &aw->mutex);
+  }
+
+  unsigned char *tmp = aw->busy;
+  aw->busy     = aw->fill;
+  aw->busy_len = aw->fill_len;
+  aw->fill     = tmp;
+  aw->fill_len = 0;
+  aw->pending  = 1;
+
+  pthread_cond_broadcast(&aw->cond);
+  size_t err = aw->err;
+  pthread_mutex_unlock(&aw->mutex);
+
+  return err;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start a worker thread compressing with 'writer'
+//
+// @param writer an initialised writer. Must not be used by the caller until
+//        'async_writer_finish()' has returned
+// @param capacity size of each of the two buffers
+// @return NULL if the thread could not be started.  Caller should fall back
+//         to compressing on the R thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+async_writer_t *async_writer_init(seekable_writer_t *writer, size_t capacity) {
+  async_writer_t *aw = (async_writer_t *)calloc(1, sizeof(async_writer_t));
+  if (aw == NULL) return NULL;
+
+  aw->writer   = writer;
+  aw->capacity = capacity;
+  aw->fill     = (unsigned char *)malloc(capacity);
+  aw->busy     = (unsigned char *)malloc(capacity);
+  if (aw->fill == NULL || aw->busy == NULL) {
+    free(aw->fill);
+    free(aw->busy);
+    free(aw);
+    return NULL;
+  }
+
+  pthread_mutex_init(&aw->mutex, NULL);
+  pthread_cond_init(&aw->cond, NULL);
+
+  if (pthread_create(&aw->thread, NULL, async_worker, aw) != 0) {
+    async_writer_free(aw);
+    return NULL;
+  }
+  aw->running = 1;
+
+  return aw;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy data into the 'fill' buffer, handing it to the worker whenever full.
+// @return 0 or a zstd error code from the worker
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t async_writer_write(async_writer_t *aw, const void *src, size_t len) {
+  const unsigned char *p = (const unsigned char *)src;
+
+  while (len > 0) {
+    size_t n = aw->capacity - aw->fill_len;
+    if (n > len) n = len;
+
+    memcpy(aw->fill + aw->fill_len, p, n);
+    aw->fill_len += n;
+    p   += n;
+    len -= n;
+
+    if (aw->fill_len == aw->capacity) {
+      size_t err = async_writer_submit(aw);
+      if (err) return err;
+    }
+  }
+
+  return aw->err;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress all data written so far and flush the writer (see 
+// 'seekable_writer_flush()').  Waits for the worker to be idle, so the
+// writer can be flushed from the R thread while the worker is waiting.
+// @return 0 or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t async_writer_flush(async_writer_t *aw) {
+  if (!aw->running) return aw->err;
+  
+  if (aw->fill_len > 0) {
+    async_writer_submit(aw);
+  }
+  
+  pthread_mutex_lock(&aw->mutex);
+  while (aw->pending) {
+    pthread_cond_wait(&aw->cond, &aw->mutex);
+  }
+  if (aw->err == 0) {
+    size_t res = seekable_writer_flush(aw->writer);
+    if (ZSTD_isError(res)) aw->err = res;
+  }
+  size_t err = aw->err;
+  pthread_mutex_unlock(&aw->mutex);
+  
+  return err;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress any remaining data and stop the worker.
+// After this returns, the writer may be used (and ended) by the caller.
+// @return 0 or a zstd error code from the worker
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t async_writer_finish(async_writer_t *aw) {
+  if (!aw->running) return aw->err;
+
+  if (aw->fill_len > 0) {
+    async_writer_submit(aw);
+  }
+
+  pthread_mutex_lock(&aw->mutex);
+  aw->quit = 1;
+  pthread_cond_broadcast(&aw->cond);
+  pthread_mutex_unlock(&aw->mutex);
+
+  pthread_join(aw->thread, NULL);
+  aw->running = 0;
+
+  return aw->err;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stop the worker (if still running) and free all memory
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void async_writer_free(async_writer_t *aw) {
+  if (aw == NULL) return;
+
+  async_writer_finish(aw);
+  pthread_mutex_destroy(&aw->mutex);
+  pthread_cond_destroy(&aw->cond);
+  free(aw->fill);
+  free(aw->busy);
+  free(aw);
+}
+
+
+#else
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// No threads on Emscripten.  Callers fall back to compressing on the R thread
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+async_writer_t *async_writer_init(seekable_writer_t *writer, size_t capacity) {
+  return NULL;
+}
+
+size_t async_writer_write(async_writer_t *aw, const void *src, size_t len) {
+  return 0;
+}
+
+size_t async_writer_flush(async_writer_t *aw) {
+  return 0;
+}
+
+size_t async_writer_finish(async_writer_t *aw) {
+  return 0;
+}
+
+void async_writer_free(async_writer_t *aw) {
+}
+
+#endif
@@ -0,0 +1,13 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Double-buffered compression on a background thread.
+// The R thread fills one buffer while a worker compresses and writes the
+// other with a 'seekable_writer_t'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct async_writer_s async_writer_t;
+
+async_writer_t *async_writer_init(seekable_writer_t *writer, size_t capacity);
+size_t async_writer_write(async_writer_t *aw, const void *src, size_t len);
+size_t async_writer_flush(async_writer_t *aw);
+size_t async_writer_finish(async_writer_t *aw);
+void   async_writer_free(async_writer_t *aw);
@@ -0,0 +1,189 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "zstd/zstd.h"
+#include "buffer-chunked.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for writing to a buffer which grows as needed.
+//
+// The buffer is a linked list of chunks.  When the current chunk is full,
+// a new (larger) chunk is appended.  Because existing data is never moved,
+// the cost of growing the buffer is just the cost of a 'malloc()'.
+//
+// This allows an R object to be serialized in a single pass, without first
+// calculating the exact size of the serialized data with a
+// dummy serialization (see 'calc-size-robust.c')
+//
+// The struct for the buffer is defined in 'buffer-chunked.h'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Chunk capacity doubles each time a chunk is added, up to this limit
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define MAX_CHUNK_SIZE (64 * 1024 * 1024)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Allocate a new chunk and append it to the buffer
+// @return the new chunk, or NULL if it couldn't be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static chunk_t *add_chunk(chunked_buffer_t *buf, size_t min_capacity) {
+
+  size_t capacity = buf->next_capacity;
+  if (capacity < min_capacity) {
+    capacity = min_capacity;
+  }
+
+  // Chunk struct and its data are allocated together
+  chunk_t *chunk = (chunk_t *)malloc(sizeof(chunk_t) + capacity);
+  if (chunk == NULL) {
+    return NULL;
+  }
+
+  chunk->next     = NULL;
+  chunk->capacity = capacity;
+  chunk->pos      = 0;
+  chunk->data     = (unsigned char *)(chunk + 1);
+
+  if (buf->tail == NULL) {
+    buf->head = chunk;
+  } else {
+    buf->tail->next = chunk;
+  }
+  buf->tail = chunk;
+
+  if (buf->next_capacity < MAX_CHUNK_SIZE) {
+    buf->next_capacity *= 2;
+  }
+
+  return chunk;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise an empty buffer with a first chunk of 'nbytes'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+chunked_buffer_t *init_chunked_buffer(size_t nbytes) {
+  chunked_buffer_t *buf = (chunked_buffer_t *)calloc(1, sizeof(chunked_buffer_t));
+  if (buf == NULL) {
+    error("init_chunked_buffer(): cannot malloc buffer");
+  }
+
+  buf->next_capacity = nbytes > 0 ? nbytes : 1;
+  if (add_chunk(buf, 0) == NULL) {
+    free(buf);
+    error("init_chunked_buffer(): cannot malloc %zu bytes", nbytes);
+  }
+
+  return buf;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free all chunks and the buffer itself
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void free_chunked_buffer(chunked_buffer_t *buf) {
+  chunk_t *chunk = buf->head;
+  while (chunk != NULL) {
+    chunk_t *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(buf);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write a byte into the buffer at the current location.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_byte_to_chunked_buffer(R_outpstream_t stream, int c) {
+  error("write_byte_to_chunked_buffer(): This function unused in binary serialization.");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write multiple bytes into the buffer at the current location.
+// If the bytes don't fit in the current chunk, then fill the current chunk
+// and put the rest into a new chunk.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_bytes_to_chunked_buffer(R_outpstream_t stream, void *src, int length) {
+  chunked_buffer_t *buf = (chunked_buffer_t *)stream->data;
+  chunk_t *chunk = buf->tail;
+
+  size_t len = (size_t)length;
+  size_t avail = chunk->capacity - chunk->pos;
+
+  if (len > avail) {
+    memcpy(chunk->data + chunk->pos, src, avail);
+    chunk->pos += avail;
+    buf->total += avail;
+    src  = (unsigned char *)src + avail;
+    len -= avail;
+    chunk = add_chunk(buf, len);
+    if (chunk == NULL) {
+      error("write_bytes_to_chunked_buffer(): cannot malloc %zu bytes", len);
+    }
+  }
+
+  memcpy(chunk->data + chunk->pos, src, len);
+  chunk->pos += len;
+  buf->total += len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress the entire contents of the chunked buffer into 'dst' as a
+// single frame.
+//
+// The total size is known at this point, so it is pledged to the context
+// and is recorded in the frame header.
+//
+// The context must not be using 'ZSTD_c_stableInBuffer' as the input
+// moves from chunk to chunk.
+// 'dst_capacity' must be at least ZSTD_compressBound(buf->total)
+//
+// @return number of compressed bytes written to 'dst' or a ZSTD error
+//         code (check with ZSTD_isError())
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t compress_chunked_buffer(ZSTD_CCtx *cctx, chunked_buffer_t *buf, void *dst, size_t dst_capacity) {
+
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  size_t res = ZSTD_CCtx_setPledgedSrcSize(cctx, (unsigned long long)buf->total);
+  if (ZSTD_isError(res)) {
+    return res;
+  }
+
+  ZSTD_outBuffer output = {
+    .dst  = dst,
+    .size = dst_capacity,
+    .pos  = 0
+  };
+
+  for (chunk_t *chunk = buf->head; chunk != NULL; chunk = chunk->next) {
+    ZSTD_inBuffer input = {
+      .src  = chunk->data,
+      .size = chunk->pos,
+      .pos  = 0
+    };
+
+    ZSTD_EndDirective mode = chunk->next == NULL ? ZSTD_e_end : ZSTD_e_continue;
+    size_t remaining;
+    do {
+      remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining)) {
+        return remaining;
+      }
+    } while (input.pos != input.size || (mode == ZSTD_e_end && remaining > 0));
+  }
+
+  return output.pos;
+}
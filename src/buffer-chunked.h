@@ -0,0 +1,30 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A single chunk of memory in a chunked buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct chunk_s {
+  struct chunk_s *next;
+  size_t capacity;
+  size_t pos;
+  unsigned char *data;
+} chunk_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A data buffer which grows by appending new chunks.
+// Data is never moved once written, so growing the buffer never needs
+// a realloc/copy of the bytes already written.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  chunk_t *head;
+  chunk_t *tail;
+  size_t total;         // total number of bytes written across all chunks
+  size_t next_capacity; // capacity of the next chunk to be allocated
+} chunked_buffer_t;
+
+chunked_buffer_t *init_chunked_buffer(size_t nbytes);
+void free_chunked_buffer(chunked_buffer_t *buf);
+
+void write_byte_to_chunked_buffer(R_outpstream_t stream, int c);
+void write_bytes_to_chunked_buffer(R_outpstream_t stream, void *src, int length);
+
+size_t compress_chunked_buffer(ZSTD_CCtx *cctx, chunked_buffer_t *buf, void *dst, size_t dst_capacity);
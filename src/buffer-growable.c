@@ -0,0 +1,173 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "zstd/zstd.h"
+#include "buffer-growable.h"
+#include "utils.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for decompressing data when the final size
+// is not known in advance e.g. frames written by 'zstd' from a pipe, 
+// which have no content size in the frame header.
+//
+// Output is written directly into an R raw vector.  When the vector is
+// full, it is replaced by one twice the size.  When decompression 
+// is complete, the user-visible length is truncated to the number of bytes
+// actually written, using the same SETLENGTH() trick as when compressing.
+//
+// When the size *is* known, the buffer can be initialised with the exact
+// size and no growth will happen.
+//
+// Usage:
+//   growable_buffer_t buf;
+//   init_growable_buffer(&buf, initial_size);  // PROTECTs 1 object
+//   ret = decompress_stream_growable(dctx, &buf, &input); // for each input chunk
+//   ret = decompress_stream_growable_end(dctx, &buf, ret);
+//   SEXP res_ = finish_growable_buffer(&buf, return_raw);
+//   UNPROTECT(1);
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Choose a starting capacity.
+// Use the content size from the frame header if it is known, otherwise 
+// guess from the compressed size.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t growable_initial_capacity(unsigned long long content_size, size_t compressed_size) {
+  if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != ZSTD_CONTENTSIZE_ERROR) {
+    return (size_t)content_size;
+  }
+  
+  size_t capacity = compressed_size * 4;
+  if (capacity < 131072) capacity = 131072;
+  return capacity;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise the buffer.  This PROTECTs the raw vector, and the caller
+// must UNPROTECT(1) when done.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void init_growable_buffer(growable_buffer_t *buf, size_t capacity) {
+  buf->vec_ = allocVector(RAWSXP, (R_xlen_t)capacity);
+  PROTECT_WITH_INDEX(buf->vec_, &buf->ipx);
+  
+  buf->output.dst  = RAW(buf->vec_);
+  buf->output.size = capacity;
+  buf->output.pos  = 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Double the capacity of the buffer.  Existing data is copied to the
+// new raw vector.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void grow_growable_buffer(growable_buffer_t *buf) {
+  size_t capacity = buf->output.size * 2;
+  if (capacity < 65536) capacity = 65536;
+  
+  SEXP vec_ = allocVector(RAWSXP, (R_xlen_t)capacity);
+  memcpy(RAW(vec_), buf->output.dst, buf->output.pos);
+  
+  buf->vec_ = vec_;
+  REPROTECT(buf->vec_, buf->ipx);
+  
+  buf->output.dst  = RAW(buf->vec_);
+  buf->output.size = capacity;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress all of 'input', growing the buffer as needed.
+//
+// The buffer is only grown when the decoder stalls with input remaining,
+// so when the buffer is initialised with the exact decompressed size it 
+// never grows (even if trailing checksum bytes arrive in a later chunk).
+//
+// @return the last return value from ZSTD_decompressStream() i.e. 0 if
+//         a frame was just completed, or a zstd error code.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t decompress_stream_growable(ZSTD_DCtx *dctx, growable_buffer_t *buf, ZSTD_inBuffer *input) {
+  size_t ret = 0;
+  
+  while (input->pos < input->size) {
+    size_t in_pos  = input->pos;
+    size_t out_pos = buf->output.pos;
+    
+    ret = ZSTD_decompressStream(dctx, &buf->output, input);
+    if (ZSTD_isError(ret)) return ret;
+    
+    if (input->pos == in_pos && buf->output.pos == out_pos) {
+      // No progress. Decoder needs more room for output
+      grow_growable_buffer(buf);
+    }
+  }
+  
+  return ret;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Call when there is no more input.  Flush any data held by the decoder.
+//
+// @param ret the last return value from 'decompress_stream_growable()'
+// @return 0 if the last frame is complete.  Non-zero if the input was 
+//         truncated, or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t decompress_stream_growable_end(ZSTD_DCtx *dctx, growable_buffer_t *buf, size_t ret) {
+  ZSTD_inBuffer empty = { .src = NULL, .size = 0, .pos = 0 };
+  
+  while (ret != 0 && !ZSTD_isError(ret)) {
+    if (buf->output.pos == buf->output.size) {
+      grow_growable_buffer(buf);
+    }
+    size_t out_pos = buf->output.pos;
+    ret = ZSTD_decompressStream(dctx, &buf->output, &empty);
+    if (buf->output.pos == out_pos) break; // Nothing left to flush
+  }
+  
+  return ret;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finalise the buffer and return the result.
+//
+// return_raw = 1  The raw vector with its length truncated to the data 
+//                 Requires: R_VERSION >= R_Version(3, 4, 0)
+// return_raw = 0  A character vector with a single string, truncated at
+//                 any embedded nul (with a warning).  This raises an error
+//                 if the string is too long, so call it after the
+//                 decompression context etc have been released.
+//
+// The returned object is protected until the caller's UNPROTECT(1)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP finish_growable_buffer(growable_buffer_t *buf, int return_raw) {
+  
+  if (!return_raw) {
+    int truncated = 0;
+    SEXP str_ = ScalarString(
+      mkchar_nul_truncated((char *)buf->output.dst, buf->output.pos, "zstd_decompress()", &truncated)
+    );
+    REPROTECT(str_, buf->ipx);
+    if (truncated) {
+      warning("zstd_decompress(): string appears to contain an embedded nul and was truncated");
+    }
+    return str_;
+  }
+  
+  if (buf->output.pos < buf->output.size) {
+    SETLENGTH(buf->vec_, (R_xlen_t)buf->output.pos);
+    SET_TRUELENGTH(buf->vec_, (R_xlen_t)buf->output.size);
+    SET_GROWABLE_BIT(buf->vec_);
+  }
+  
+  return buf->vec_;
+}
@@ -0,0 +1,19 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// An R raw vector used as a decompression output buffer which doubles 
+// in size whenever it becomes full.
+// The raw vector is protected with an index so it can be replaced on growth.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP vec_;
+  PROTECT_INDEX ipx;
+  ZSTD_outBuffer output; // 'dst' points into 'vec_'. 'size' is the capacity
+} growable_buffer_t;
+
+size_t growable_initial_capacity(unsigned long long content_size, size_t compressed_size);
+void init_growable_buffer(growable_buffer_t *buf, size_t capacity);
+void grow_growable_buffer(growable_buffer_t *buf);
+
+size_t decompress_stream_growable(ZSTD_DCtx *dctx, growable_buffer_t *buf, ZSTD_inBuffer *input);
+size_t decompress_stream_growable_end(ZSTD_DCtx *dctx, growable_buffer_t *buf, size_t ret);
+
+SEXP finish_growable_buffer(growable_buffer_t *buf, int return_raw);
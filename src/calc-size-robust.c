@@ -20,9 +20,11 @@
 // This is a very very fast operation.
 //
 // This dummy serializtion target is used to count the bytes so that the
-// actual serialization only has to use a statically sized buffer.
-// This avoids having to use a dynamically resizeable buffer and thus actually
-// saves some time by not having to realloc memory when resizing.
+// total size can be pledged to the compressor before streaming serialization
+// to a file or connection starts.
+//
+// The count is a 'size_t' so that objects larger than 2GB are counted 
+// correctly.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 
@@ -35,7 +37,7 @@
 // have to extract it first
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void count_byte(R_outpstream_t stream, int c) {
-  int *count = (int *)stream->data;
+  size_t *count = (size_t *)stream->data;
   *count += 1;
 }
 
@@ -47,8 +49,8 @@ void count_byte(R_outpstream_t stream, int c) {
 // have to extract it first
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 void count_bytes(R_outpstream_t stream, void *src, int length) {
-  int *count = (int *)stream->data;
-  *count += length;
+  size_t *count = (size_t *)stream->data;
+  *count += (size_t)length;
 }
 
 
@@ -56,10 +58,10 @@ void count_bytes(R_outpstream_t stream, void *src, int length) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Serialize an R object, but ony count the bytes.  C function
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-int calc_serialized_size(SEXP robj) {
+size_t calc_serialized_size(SEXP robj) {
 
   // Initialise the count
-  int count = 0;
+  size_t count = 0;
 
   // Create the output stream structure
   struct R_outpstream_st output_stream;
@@ -86,7 +88,8 @@ int calc_serialized_size(SEXP robj) {
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Serialize an R object, but ony count the bytes. R shim function
+// Returns a double as the size may exceed the range of an R integer
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 SEXP calc_serialized_size_(SEXP robj) {
-  return ScalarInteger(calc_serialized_size(robj));
+  return ScalarReal((double)calc_serialized_size(robj));
 }
@@ -1,2 +1,2 @@
 
-int calc_serialized_size(SEXP robj);
+size_t calc_serialized_size(SEXP robj);
@@ -13,6 +13,7 @@
 #include "zstd/zstd.h"
 #include "cctx.h"
 #include "utils.h"
+#include "dict-objects.h"
 
 
 
@@ -282,8 +283,23 @@ ZSTD_CCtx *init_cctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
           error("init_cctx(): Couldn't set checksum flag");  
         }
       }
+    } else if (strcmp(opt_name, "dedicated_search") == 0) {
+      // ZSTD_c_enableDedicatedDictSearch only has an effect when a dictionary
+      // is loaded into this CCtx (or a CDict made with the same setting) 
+      // and the level uses ZSTD_greedy..ZSTD_lazy2.  Other levels silently 
+      // fall back to the normal search structures. 
+      // See the 2024-02-27 note above: it had no effect on a CCtx with no
+      // dictionary at the default level 3 (ZSTD_dfast).
+      if (asLogical(val_)) {
+        size_t res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableDedicatedDictSearch, 1);
+        if (ZSTD_isError(res)) {
+          error("init_cctx(): Couldn't set dedicated dictionary search");  
+        }
+      }
     } else if (strcmp(opt_name, "dict") == 0) {
       dict_ = val_;
+    } else if (strcmp(opt_name, "frame_size") == 0) {
+      // Handled by the seekable writer. See 'seekable_frame_size_opt()'
     } else {
       if (!quiet) warning("init_cctx(): Unknown option '%s'", opt_name);
     }
@@ -303,8 +319,10 @@ ZSTD_CCtx *init_cctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
       unsigned char *dict = read_file(filename, &fsize);
       status = ZSTD_CCtx_loadDictionary(cctx, dict, fsize);
       free(dict);
+    } else if (is_zstd_cdict(dict_)) {
+      status = ZSTD_CCtx_refCDict(cctx, external_ptr_to_zstd_cdict(dict_));
     } else {
-      error("init_cctx(): 'dict' must be a raw vector or a filename");
+      error("init_cctx(): 'dict' must be a raw vector, a filename or a ZSTD_CDict");
     }
     if (ZSTD_isError(status)) {
       error("init_cctx(): Error initialising dict. %s", ZSTD_getErrorName(status));
@@ -318,7 +336,7 @@ ZSTD_CCtx *init_cctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Initialize a ZSTD_CCtx pointer from R
-// @param dict could be a raw vector holding a dictionary or a filename
+// @param dict could be a raw vector holding a dictionary, a filename or a ZSTD_CDict
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 SEXP init_cctx_(SEXP opts_) {
   
@@ -326,8 +344,10 @@ SEXP init_cctx_(SEXP opts_) {
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Wrap 'cctx' as an R external pointer
+  // 'opts_' is kept as the protected value so that a ZSTD_CDict referenced
+  // by this context is not garbage collected while the context is alive
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  SEXP cctx_ = PROTECT(R_MakeExternalPtr(cctx, R_NilValue, R_NilValue));
+  SEXP cctx_ = PROTECT(R_MakeExternalPtr(cctx, R_NilValue, opts_));
   R_RegisterCFinalizer(cctx_, zstd_cctx_finalizer);
   Rf_setAttrib(cctx_, R_ClassSymbol, Rf_mkString("ZSTD_CCtx"));
   
@@ -13,6 +13,7 @@
 #include "zstd/zstd.h"
 #include "dctx.h"
 #include "utils.h"
+#include "dict-objects.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Unpack an R external pointer to a C pointer 'ZSTD_DCtx *'
@@ -103,6 +104,19 @@ void dctx_set_stable_buffers(ZSTD_DCtx *dctx) {
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Streaming decompression into a buffer which may grow (or move) between
+// calls.  A user-supplied 'dctx' may have had stable buffers set by an 
+// earlier call to 'zstd_decompress()', so this must be reset.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void dctx_unset_stable_buffers(ZSTD_DCtx *dctx) {
+  size_t res = ZSTD_DCtx_setParameter(dctx, ZSTD_d_stableOutBuffer, 0);
+  if (ZSTD_isError(res)) {
+    error("zstd_decompress_(): Could not unset 'ZSTD_d_stableOutBuffer'");
+  }
+}
+
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // 
@@ -167,6 +181,8 @@ ZSTD_DCtx *init_dctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
       }
     } else if (strcmp(opt_name, "dict") == 0) {
       dict_ = val_;
+    } else if (strcmp(opt_name, "num_threads") == 0) {
+      // Only used for batch decompression. See 'raw-list.c'
     } else {
       if (!quiet) warning("init_dctx(): Unknown option '%s'", opt_name);
     }
@@ -185,8 +201,10 @@ ZSTD_DCtx *init_dctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
       unsigned char *dict = read_file(filename, &fsize);
       status = ZSTD_DCtx_loadDictionary(dctx, dict, fsize);
       free(dict);
+    } else if (is_zstd_ddict(dict_)) {
+      status = ZSTD_DCtx_refDDict(dctx, external_ptr_to_zstd_ddict(dict_));
     } else {
-      error("init_dctx(): 'dict' must be a raw vector or a filename");
+      error("init_dctx(): 'dict' must be a raw vector, a filename or a ZSTD_DDict");
     }
     if (ZSTD_isError(status)) {
       error("init_dctx(): Error initialising dict. %s", ZSTD_getErrorName(status));
@@ -198,9 +216,27 @@ ZSTD_DCtx *init_dctx_with_opts(SEXP opts_, int stable_buffers, int quiet) {
 
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Call 'fun(data)' while using 'dctx', and free it afterwards.  It is also 
+// freed if 'fun' raises an R error (including a failed R allocation).
+// A context supplied by the user ('dctx_' is not NULL) is never freed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void free_dctx_cleanup(void *data) {
+  ZSTD_freeDCtx((ZSTD_DCtx *)data);
+}
+
+SEXP with_dctx(SEXP (*fun)(void *), void *data, ZSTD_DCtx *dctx, SEXP dctx_) {
+  if (!isNull(dctx_)) {
+    return fun(data);
+  }
+  return R_ExecWithCleanup(fun, data, free_dctx_cleanup, dctx);
+}
+
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Initialize a ZSTD_DCtx pointer from R
-// @param dict could be a raw vector holding a dictionary or a filename
+// @param dict could be a raw vector holding a dictionary, a filename or a ZSTD_DDict
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 SEXP init_dctx_(SEXP opts_) {
 
@@ -208,8 +244,10 @@ SEXP init_dctx_(SEXP opts_) {
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Wrap 'dctx' into an R external pointer
+  // 'opts_' is kept as the protected value so that a ZSTD_DDict referenced
+  // by this context is not garbage collected while the context is alive
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  SEXP dctx_ = PROTECT(R_MakeExternalPtr(dctx, R_NilValue, R_NilValue));
+  SEXP dctx_ = PROTECT(R_MakeExternalPtr(dctx, R_NilValue, opts_));
   R_RegisterCFinalizer(dctx_, zstd_dctx_finalizer);
   Rf_setAttrib(dctx_, R_ClassSymbol, Rf_mkString("ZSTD_DCtx"));
   
@@ -0,0 +1,387 @@
+
+
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zstd/zstd.h"
+#include "dict-objects.h"
+#include "utils.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pre-digested dictionaries.
+//
+// Loading a raw dictionary into a context (ZSTD_CCtx_loadDictionary())
+// means zstd has to build its search tables (or entropy tables for
+// decompression) from the dictionary bytes every time a context is
+// created.  For small messages this can cost more than the compression itself.
+//
+// A CDict/DDict holds the digested dictionary and can be referenced by
+// any number of contexts (and threads) at no extra cost.
+//
+// Because a context only references the CDict/DDict, the R object wrapping
+// the CDict/DDict must outlive every context using it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fetch the raw bytes of a dictionary given as a raw vector or a filename.
+// '*needs_free' is set if the caller must 'free()' the returned pointer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *dict_bytes(SEXP dict_, size_t *dict_size, int *needs_free, const char *caller) {
+  *needs_free = 0;
+  if (TYPEOF(dict_) == RAWSXP) {
+    *dict_size = (size_t)length(dict_);
+    return (void *)RAW(dict_);
+  } else if (TYPEOF(dict_) == STRSXP && length(dict_) == 1) {
+    const char *filename = CHAR(STRING_ELT(dict_, 0));
+    *needs_free = 1;
+    return (void *)read_file(filename, dict_size);
+  }
+
+  error("%s: 'dict' must be a raw vector or a filename", caller);
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Is this an R external pointer to a CDict/DDict?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int is_zstd_cdict(SEXP x_) {
+  return TYPEOF(x_) == EXTPTRSXP && inherits(x_, "ZSTD_CDict");
+}
+
+int is_zstd_ddict(SEXP x_) {
+  return TYPEOF(x_) == EXTPTRSXP && inherits(x_, "ZSTD_DDict");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack an R external pointer to a C pointer 'ZSTD_CDict *'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ZSTD_CDict *external_ptr_to_zstd_cdict(SEXP cdict_) {
+  if (is_zstd_cdict(cdict_)) {
+    ZSTD_CDict *cdict = (ZSTD_CDict *)R_ExternalPtrAddr(cdict_);
+    if (cdict != NULL) {
+      return cdict;
+    }
+  }
+
+  error("ZSTD_CDict pointer is invalid/NULL.");
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack an R external pointer to a C pointer 'ZSTD_DDict *'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ZSTD_DDict *external_ptr_to_zstd_ddict(SEXP ddict_) {
+  if (is_zstd_ddict(ddict_)) {
+    ZSTD_DDict *ddict = (ZSTD_DDict *)R_ExternalPtrAddr(ddict_);
+    if (ddict != NULL) {
+      return ddict;
+    }
+  }
+
+  error("ZSTD_DDict pointer is invalid/NULL.");
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finalizers for 'ZSTD_CDict' and 'ZSTD_DDict' objects
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstd_cdict_finalizer(SEXP cdict_) {
+  ZSTD_CDict *cdict = (ZSTD_CDict *) R_ExternalPtrAddr(cdict_);
+  if (cdict == NULL) {
+    Rprintf("NULL ZSTD_CDict in finalizer");
+    return;
+  }
+
+  ZSTD_freeCDict(cdict);
+  R_ClearExternalPtr(cdict_);
+}
+
+static void zstd_ddict_finalizer(SEXP ddict_) {
+  ZSTD_DDict *ddict = (ZSTD_DDict *) R_ExternalPtrAddr(ddict_);
+  if (ddict == NULL) {
+    Rprintf("NULL ZSTD_DDict in finalizer");
+    return;
+  }
+
+  ZSTD_freeDDict(ddict);
+  R_ClearExternalPtr(ddict_);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialize a ZSTD_CDict from R
+//
+// The compression level is baked into the CDict. Any context referencing
+// this CDict will use this level regardless of its own setting.
+//
+// @param dict_ raw vector or filename
+// @param level_ compression level
+// @param dedicated_search_ logical. Build the read-optimised search 
+//        structures for the dictionary? Only supported by the 
+//        greedy/lazy/lazy2 strategies (roughly levels 5-12), and ignored 
+//        by zstd at other levels. See notes in 'cctx.c'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP init_cdict_(SEXP dict_, SEXP level_, SEXP dedicated_search_) {
+
+  int level = asInteger(level_);
+  if (level == NA_INTEGER) {
+    error("init_cdict(): 'level' must be an integer");
+  }
+  level = level < -5 ? -5 : level;
+  level = level > 22 ? 22 : level;
+
+  size_t dict_size;
+  int needs_free;
+  void *dict = dict_bytes(dict_, &dict_size, &needs_free, "init_cdict()");
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Parameters for the CDict.
+  // Dictionary content is copied into the CDict, so the R vector (or the
+  // file contents) are not needed after this call.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  ZSTD_CCtx_params *params = ZSTD_createCCtxParams();
+  if (params == NULL) {
+    if (needs_free) free(dict);
+    error("init_cdict(): Couldn't initialise memory for parameters");
+  }
+  ZSTD_CCtxParams_init(params, level);
+  if (asLogical(dedicated_search_) == TRUE) {
+    size_t res = ZSTD_CCtxParams_setParameter(params, ZSTD_c_enableDedicatedDictSearch, 1);
+    if (ZSTD_isError(res)) {
+      ZSTD_freeCCtxParams(params);
+      if (needs_free) free(dict);
+      error("init_cdict(): Couldn't set dedicated dictionary search");
+    }
+  }
+
+  ZSTD_CDict *cdict = ZSTD_createCDict_advanced2(
+    dict, dict_size, ZSTD_dlm_byCopy, ZSTD_dct_auto, params, ZSTD_defaultCMem
+  );
+
+  ZSTD_freeCCtxParams(params);
+  if (needs_free) free(dict);
+
+  if (cdict == NULL) {
+    error("init_cdict(): Couldn't create dictionary");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Wrap 'cdict' as an R external pointer
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP cdict_ = PROTECT(R_MakeExternalPtr(cdict, R_NilValue, R_NilValue));
+  R_RegisterCFinalizer(cdict_, zstd_cdict_finalizer);
+  Rf_setAttrib(cdict_, R_ClassSymbol, Rf_mkString("ZSTD_CDict"));
+
+  UNPROTECT(1);
+  return cdict_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialize a ZSTD_DDict from R
+//
+// @param dict_ raw vector or filename
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP init_ddict_(SEXP dict_) {
+
+  size_t dict_size;
+  int needs_free;
+  void *dict = dict_bytes(dict_, &dict_size, &needs_free, "init_ddict()");
+
+  // Dictionary content is copied into the DDict
+  ZSTD_DDict *ddict = ZSTD_createDDict(dict, dict_size);
+  if (needs_free) free(dict);
+
+  if (ddict == NULL) {
+    error("init_ddict(): Couldn't create dictionary");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Wrap 'ddict' as an R external pointer
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP ddict_ = PROTECT(R_MakeExternalPtr(ddict, R_NilValue, R_NilValue));
+  R_RegisterCFinalizer(ddict_, zstd_ddict_finalizer);
+  Rf_setAttrib(ddict_, R_ClassSymbol, Rf_mkString("ZSTD_DDict"));
+
+  UNPROTECT(1);
+  return ddict_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Process-wide dictionary registry.
+//
+// Dictionaries are registered once (as DDicts) and are selected
+// automatically by the dictionary ID in the frame header when 
+// decompressing without a user-supplied 'dctx' or 'dict'.
+//
+// The registry is only modified from R (main thread), but is read by
+// decompression worker threads, so lookups use only these C arrays.
+// Each 'ddict_' is preserved from garbage collection while registered.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  uint32_t id;
+  ZSTD_DDict *ddict;
+  SEXP ddict_;
+} registry_entry_t;
+
+static registry_entry_t *registry = NULL;
+static int registry_n        = 0;
+static int registry_capacity = 0;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find a registered dictionary by ID.  Returns NULL if not registered
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static registry_entry_t *registry_find(uint32_t id) {
+  for (int i = 0; i < registry_n; i++) {
+    if (registry[i].id == id) {
+      return &registry[i];
+    }
+  }
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Register a dictionary.  A dictionary with the same ID is replaced.
+//
+// @param dict_ raw vector, filename or ZSTD_DDict
+// @return dictionary ID
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_dict_register_(SEXP dict_) {
+  
+  SEXP ddict_ = is_zstd_ddict(dict_) ? dict_ : init_ddict_(dict_);
+  PROTECT(ddict_);
+  ZSTD_DDict *ddict = external_ptr_to_zstd_ddict(ddict_);
+  
+  uint32_t id = ZSTD_getDictID_fromDDict(ddict);
+  if (id == 0) {
+    error("zstd_dict_register(): Dictionary has no ID so can not be selected from frame headers");
+  }
+  
+  registry_entry_t *entry = registry_find(id);
+  if (entry == NULL) {
+    if (registry_n == registry_capacity) {
+      int capacity = registry_capacity == 0 ? 16 : 2 * registry_capacity;
+      registry_entry_t *tmp = realloc(registry, (size_t)capacity * sizeof(registry_entry_t));
+      if (tmp == NULL) {
+        error("zstd_dict_register(): Couldn't grow dictionary registry");
+      }
+      registry = tmp;
+      registry_capacity = capacity;
+    }
+    entry = &registry[registry_n++];
+  } else {
+    R_ReleaseObject(entry->ddict_);
+  }
+  
+  R_PreserveObject(ddict_);
+  entry->id     = id;
+  entry->ddict  = ddict;
+  entry->ddict_ = ddict_;
+  
+  UNPROTECT(1);
+  return ScalarInteger((int32_t)id);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Remove dictionaries from the registry
+//
+// @param ids_ integer vector of dictionary IDs. NULL to remove all
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_dict_unregister_(SEXP ids_) {
+  
+  if (isNull(ids_)) {
+    for (int i = 0; i < registry_n; i++) {
+      R_ReleaseObject(registry[i].ddict_);
+    }
+    registry_n = 0;
+    return R_NilValue;
+  }
+  
+  ids_ = PROTECT(coerceVector(ids_, INTSXP));
+  for (R_xlen_t j = 0; j < xlength(ids_); j++) {
+    registry_entry_t *entry = registry_find((uint32_t)INTEGER(ids_)[j]);
+    if (entry == NULL) continue;
+    R_ReleaseObject(entry->ddict_);
+    *entry = registry[--registry_n];
+  }
+  
+  UNPROTECT(1);
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// IDs of all registered dictionaries
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_dict_registered_(void) {
+  SEXP ids_ = PROTECT(allocVector(INTSXP, registry_n));
+  for (int i = 0; i < registry_n; i++) {
+    INTEGER(ids_)[i] = (int32_t)registry[i].id;
+  }
+  UNPROTECT(1);
+  return ids_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Should the registry be used to select the dictionary?
+// Only for contexts created internally when the user has not set 'dict'.
+// Call from the main thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int use_dict_registry(SEXP dctx_, SEXP opts_) {
+  if (registry_n == 0 || !isNull(dctx_)) {
+    return 0;
+  }
+  
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (isNewList(opts_) && !isNull(nms_)) {
+    for (int i = 0; i < length(opts_); i++) {
+      if (strcmp(CHAR(STRING_ELT(nms_, i)), "dict") == 0 && !isNull(VECTOR_ELT(opts_, i))) {
+        return 0;
+      }
+    }
+  }
+  
+  return 1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Reference the registered dictionary matching the dictionary ID in the 
+// frame header at 'src'.  If the frame has no dictionary ID (or it 
+// is not registered) the context is returned to no-dictionary mode, and 
+// zstd will report a dictionary mismatch for frames which needed one.
+//
+// The context must be at the start of a frame.
+// Safe to call from worker threads.
+//
+// @return the R external pointer for the dictionary, or R_NilValue. 
+//         The caller must keep this alive if it keeps the context 
+//         beyond the current '.Call()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP dctx_select_registered_dict(ZSTD_DCtx *dctx, const void *src, size_t src_size) {
+  uint32_t id = ZSTD_getDictID_fromFrame(src, src_size);
+  registry_entry_t *entry = id == 0 ? NULL : registry_find(id);
+  
+  ZSTD_DCtx_refDDict(dctx, entry == NULL ? NULL : entry->ddict);
+  
+  return entry == NULL ? R_NilValue : entry->ddict_;
+}
@@ -0,0 +1,11 @@
+
+int is_zstd_cdict(SEXP x_);
+int is_zstd_ddict(SEXP x_);
+
+ZSTD_CDict *external_ptr_to_zstd_cdict(SEXP cdict_);
+ZSTD_DDict *external_ptr_to_zstd_ddict(SEXP ddict_);
+
+SEXP init_ddict_(SEXP dict_);
+
+int  use_dict_registry(SEXP dctx_, SEXP opts_);
+SEXP dctx_select_registered_dict(ZSTD_DCtx *dctx, const void *src, size_t src_size);
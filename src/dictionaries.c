@@ -16,6 +16,7 @@
 #include "utils.h"
 
 #include "dictionaries.h"
+#include "dict-objects.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Retrieve the ID of the dictionary.  Returns zero if not a dictionary
@@ -28,6 +29,12 @@ SEXP zstd_dict_id_(SEXP src_) {
   size_t src_size;
   char buf[ZSTD_FRAMEHEADERSIZE_MAX];
   
+  if (is_zstd_cdict(src_)) {
+    return ScalarInteger((int32_t)ZSTD_getDictID_fromCDict(external_ptr_to_zstd_cdict(src_)));
+  } else if (is_zstd_ddict(src_)) {
+    return ScalarInteger((int32_t)ZSTD_getDictID_fromDDict(external_ptr_to_zstd_ddict(src_)));
+  }
+  
   if (TYPEOF(src_) == RAWSXP) {
     src = (void *)RAW(src_);
     src_size = (size_t)length(src_);
@@ -75,84 +82,238 @@ SEXP zstd_dict_id_(SEXP src_) {
 //    the actual lengths of all the individual samples (so that zstd can
 //    unpack them and learn from them one-by-one)
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_) {
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Deterministic pseudo-random numbers (splitmix64) for sample selection.
+// The same seed selects the same samples on every platform.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Shuffle sample indices in place (Fisher-Yates)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void shuffle_order(uint32_t *order, uint32_t n, int seed) {
+  uint64_t state = (uint64_t)seed;
+  for (uint32_t i = n - 1; i > 0; i--) {
+    uint32_t j = (uint32_t)(splitmix64(&state) % ((uint64_t)i + 1));
+    uint32_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of a sample.
+// Samples are raw vectors, strings, or (for a character vector) filenames.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t sample_size(SEXP samples_, uint32_t i, int is_file) {
+  if (is_file) {
+    const char *filename = CHAR(STRING_ELT(samples_, i));
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+      error("zstd_train_dictionary(): Couldn't open file '%s'", filename);
+    }
+    long long fsize = seek_file(fp, 0, SEEK_END);
+    fclose(fp);
+    if (fsize < 0) {
+      error("zstd_train_dictionary(): Couldn't determine size of '%s'", filename);
+    }
+    return (size_t)fsize;
+  }
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Unpack and sanity check args
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (!isNewList(samples_)) {
-    error("zstd_train_dictionary(): samples must be provided as a list of raw vectors or character strings");
+  SEXP elem_ = VECTOR_ELT(samples_, i);
+  if (TYPEOF(elem_) == RAWSXP) {
+    if (length(elem_) < 8) {
+      error("zstd_train_dictionary(): When samples are raw vectors, all vector lengths must be >= 8 bytes");
+    }
+    return (size_t)length(elem_);
+  } else if (TYPEOF(elem_) == STRSXP) {
+    if (length(elem_) != 1) {
+      warning("zstd_train_dictionary(): When samples are a list of character vectors, each vector must only contain a single string");
+    }
+    return (size_t)strlen(CHAR(STRING_ELT(elem_, 0)));
   }
   
-  size_t dictBufferCapacity = (size_t)asInteger(size_);
-  uint32_t nbSamples = (uint32_t)length(samples_);
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy a sample into the training buffer. For files, the file is read 
+// directly into the buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int copy_sample(SEXP samples_, uint32_t i, int is_file, unsigned char *dst, size_t len) {
+  if (is_file) {
+    FILE *fp = fopen(CHAR(STRING_ELT(samples_, i)), "rb");
+    if (fp == NULL) return 0;
+    size_t nread = fread(dst, 1, len, fp);
+    fclose(fp);
+    return nread == len;
+  }
   
-  if (nbSamples == 0) {
-    error("zstd_train_dictionary(): No samples provided");
+  SEXP elem_ = VECTOR_ELT(samples_, i);
+  if (TYPEOF(elem_) == RAWSXP) {
+    memcpy(dst, RAW(elem_), len);
+  } else if (TYPEOF(elem_) == STRSXP) {
+    memcpy(dst, CHAR(STRING_ELT(elem_, 0)), len);
+  }
+  return 1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Dictionary optimizer settings.
+// Zero for any parameter means "use the zstd default" (or "search over a 
+// range of values" for 'k' and 'd' when optimizing).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define OPTIM_NONE      0
+#define OPTIM_COVER     1
+#define OPTIM_FASTCOVER 2
+
+typedef struct {
+  int method;
+  unsigned nbThreads;
+  unsigned k;
+  unsigned d;
+  unsigned f;
+  unsigned steps;
+  unsigned accel;
+  double splitPoint;
+} train_opts_t;
+
+
+static unsigned opt_unsigned(SEXP val_, const char *name, unsigned lo, unsigned hi) {
+  int val = asInteger(val_);
+  if (val == NA_INTEGER || val < (int)lo || val > (int)hi) {
+    error("zstd_train_dictionary(): '%s' must be an integer in the range [%u, %u]", name, lo, hi);
   }
+  return (unsigned)val;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Parse the optimizer method and its parameters.
+//
+// @param optim_ FALSE, TRUE (cover), "cover" or "fastcover"
+// @param num_threads_ number of threads for the parameter search
+// @param opts_ named list of optimizer parameters
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static train_opts_t parse_train_opts(SEXP optim_, SEXP num_threads_, SEXP opts_) {
+  train_opts_t to;
+  memset(&to, 0, sizeof(to));
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // 'samples_' must be a list containing raw vectors.
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t total_len = 0;
-  for (uint32_t i = 0; i < nbSamples; i++) {
-    SEXP elem_ = VECTOR_ELT(samples_, i);
-    if (TYPEOF(elem_) == RAWSXP) {
-      if (length(elem_) < 8) {
-        error("zstd_train_dictionary(): When samples are raw vectors, all vector lengths must be >= 8 bytes");
-      }
-      total_len += (size_t)length(elem_);
-    } else if (TYPEOF(elem_) == STRSXP) {
-      if (length(elem_) != 1) {
-        warning("zstd_train_dictionary(): When samples are a list of character vectors, each vector must only contain a single string");
-      }
-      total_len += (size_t)strlen(CHAR(STRING_ELT(elem_, 0)));
+  if (TYPEOF(optim_) == STRSXP && length(optim_) == 1) {
+    const char *method = CHAR(STRING_ELT(optim_, 0));
+    if (strcmp(method, "cover") == 0) {
+      to.method = OPTIM_COVER;
+    } else if (strcmp(method, "fastcover") == 0) {
+      to.method = OPTIM_FASTCOVER;
+    } else {
+      error("zstd_train_dictionary(): 'optim' must be TRUE, FALSE, 'cover' or 'fastcover'");
     }
+  } else {
+    to.method = asLogical(optim_) == TRUE ? OPTIM_COVER : OPTIM_NONE;
   }
   
-  if (total_len < 100 * dictBufferCapacity) {
-    warning("zstd_train_dictionary() ZSTD documentation recommends training data size 100x dictionary size.\nOnly supplied with %.1fx", (double)total_len / (double)dictBufferCapacity);
+  int num_threads = asInteger(num_threads_);
+  to.nbThreads = num_threads > 1 ? (unsigned)num_threads : 1;
+  
+  if (isNull(opts_) || length(opts_) == 0) {
+    return to;
   }
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Allocate
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned char *samplesBuffer = (unsigned char *)malloc(total_len);
-  if (samplesBuffer == NULL) {
-    error("zstd_train_dictionary(): Could not allocate %zu bytes for 'samplesBuffer'", total_len);
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (!isNewList(opts_) || isNull(nms_)) {
+    error("zstd_train_dictionary(): optimizer options must be a named list");
   }
-  size_t *samplesSizes = (size_t *)calloc(nbSamples, sizeof(size_t));
-  if (samplesSizes == NULL) {
-    error("zstd_train_dictionary(): Could not allocate %i * %zu = %zu bytes for 'samplesSizes'", nbSamples, sizeof(size_t), nbSamples * sizeof(size_t));
+  
+  for (int i = 0; i < length(opts_); i++) {
+    const char *opt_name = CHAR(STRING_ELT(nms_, i));
+    SEXP val_ = VECTOR_ELT(opts_, i);
+    
+    if (strcmp(opt_name, "k") == 0) {
+      to.k = opt_unsigned(val_, "k", 0, 1 << 20);
+    } else if (strcmp(opt_name, "d") == 0) {
+      to.d = opt_unsigned(val_, "d", 0, 16);
+    } else if (strcmp(opt_name, "f") == 0) {
+      to.f = opt_unsigned(val_, "f", 0, 31);
+    } else if (strcmp(opt_name, "steps") == 0) {
+      to.steps = opt_unsigned(val_, "steps", 0, 1 << 16);
+    } else if (strcmp(opt_name, "accel") == 0) {
+      to.accel = opt_unsigned(val_, "accel", 0, 10);
+    } else if (strcmp(opt_name, "split_point") == 0) {
+      double split_point = asReal(val_);
+      if (ISNAN(split_point) || split_point < 0 || split_point > 1) {
+        error("zstd_train_dictionary(): 'split_point' must be in the range [0, 1]");
+      }
+      to.splitPoint = split_point;
+    } else {
+      warning("zstd_train_dictionary(): Unknown option '%s'", opt_name);
+    }
   }
+  
+  if (to.k > 0 && to.d > to.k) {
+    error("zstd_train_dictionary(): 'd' must not be larger than 'k'");
+  }
+  
+  return to;
+}
+
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Train a dictionary from samples laid end-to-end in 'samplesBuffer'.
+// 'samplesBuffer' and 'samplesSizes' are owned by the caller, and must be
+// released by R (or a cleanup) if this raises an error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP train_from_samples(unsigned char *samplesBuffer, size_t *samplesSizes, uint32_t nbSamples,
+                               size_t dictBufferCapacity, uint32_t optim_shrink_allow, 
+                               train_opts_t *to) {
+  
   SEXP dictBuffer_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)dictBufferCapacity));
   unsigned char *dictBuffer = (unsigned char *)RAW(dictBuffer_);
 
-  size_t pos = 0;
-  for (uint32_t i = 0; i < length(samples_); i++) {
-    SEXP elem_ = VECTOR_ELT(samples_, i);
-    if (TYPEOF(elem_) == RAWSXP) {
-      size_t len = (size_t)length(elem_);
-      samplesSizes[i] = len;
-      memcpy(samplesBuffer + pos, RAW(elem_), len);
-      pos += len;
-    } else if (TYPEOF(elem_) == STRSXP) {
-      const char *tmp = CHAR(STRING_ELT(elem_, 0));
-      size_t len = (size_t)strlen(tmp);
-      samplesSizes[i] = len;
-      memcpy(samplesBuffer + pos, (void *)tmp, len);
-      pos += len;
-    }
-  }
-
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Train
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   size_t actual_dict_size;
   
-  if (!asLogical(optim_)) {
+  if (to->method == OPTIM_NONE) {
     actual_dict_size  = ZDICT_trainFromBuffer((void *)dictBuffer, dictBufferCapacity, (void *)samplesBuffer, samplesSizes, nbSamples);
+  } else if (to->method == OPTIM_FASTCOVER) {
+    
+    // fastCover samples dmers via a hashed frequency array of 2^f entries 
+    // rather than cover's suffix array, so it needs roughly 6 * 2^f bytes
+    // per thread instead of ~8 bytes per input byte, and is much faster.
+    // 'splitPoint' defaults to 0.75 (i.e. hold out 25% of samples for 
+    // scoring candidate parameters).
+    //
+    // ZDICTLIB_STATIC_API size_t ZDICT_optimizeTrainFromBuffer_fastCover(
+    //     void* dictBuffer, size_t dictBufferCapacity,
+    //     const void* samplesBuffer, const size_t* samplesSizes, unsigned nbSamples,
+    //     ZDICT_fastCover_params_t* parameters);
+    //
+    ZDICT_fastCover_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.k          = to->k;
+    params.d          = to->d;
+    params.f          = to->f;
+    params.steps      = to->steps;
+    params.accel      = to->accel;
+    params.nbThreads  = to->nbThreads;
+    params.splitPoint = to->splitPoint;
+    if (optim_shrink_allow > 0) {
+      params.shrinkDict = 1;
+      params.shrinkDictMaxRegression = optim_shrink_allow;
+    }
+    actual_dict_size = ZDICT_optimizeTrainFromBuffer_fastCover(
+      dictBuffer, dictBufferCapacity,
+      samplesBuffer, samplesSizes, (uint32_t)nbSamples, &params);
   } else {
     
     // typedef struct {
@@ -190,7 +351,11 @@ SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_s
     //
     ZDICT_cover_params_t params;
     memset(&params, 0, sizeof(params));
-    uint32_t optim_shrink_allow  = (uint32_t)asInteger(optim_shrink_allow_);
+    params.k          = to->k;
+    params.d          = to->d;
+    params.steps      = to->steps;
+    params.nbThreads  = to->nbThreads;
+    params.splitPoint = to->splitPoint;
     if (optim_shrink_allow > 0) {
       params.shrinkDict = 1;
       params.shrinkDictMaxRegression = optim_shrink_allow;
@@ -201,8 +366,6 @@ SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_s
   }
   
   if (ZDICT_isError(actual_dict_size)) {
-    free(samplesBuffer);
-    free(samplesSizes);
     UNPROTECT(1);
     error("zstd_train_dictionary() Training error %s", ZDICT_getErrorName(actual_dict_size));
   }
@@ -226,15 +389,570 @@ SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_s
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  free(samplesBuffer);
-  free(samplesSizes);
   UNPROTECT(1);
   return dictBuffer_;
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Train a dictionary.
+//
+// ZDICT needs all samples in one contiguous buffer, so only the samples 
+// selected for training are ever copied into it.
+// If the samples total more than 'max_training_size_' bytes, then samples are
+// taken in a (seeded) random order until the budget is filled.  Samples 
+// which would overflow the budget are skipped.
+//
+// @param samples_ list of raw vectors or strings, or a character vector 
+//        of filenames (one sample per file)
+// @param optim_ FALSE, TRUE (cover), "cover" or "fastcover"
+// @param max_training_size_ maximum bytes of samples to use. NULL for all
+// @param seed_ seed for sample selection
+// @param num_threads_ number of threads for the optimizer's parameter search
+// @param opts_ named list of optimizer parameters: k, d, f, steps, accel, 
+//        split_point
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_,
+                            SEXP max_training_size_, SEXP seed_, SEXP num_threads_, SEXP opts_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack and sanity check args
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int is_file = TYPEOF(samples_) == STRSXP;
+  if (!isNewList(samples_) && !is_file) {
+    error("zstd_train_dictionary(): samples must be provided as a list of raw vectors or character strings, or a character vector of filenames");
+  }
+  
+  size_t dictBufferCapacity = (size_t)asInteger(size_);
+  uint32_t n = (uint32_t)length(samples_);
+  
+  if (n == 0) {
+    error("zstd_train_dictionary(): No samples provided");
+  }
+  
+  double max_training_size = isNull(max_training_size_) ? R_PosInf : asReal(max_training_size_);
+  if (ISNAN(max_training_size) || max_training_size <= 0) {
+    error("zstd_train_dictionary(): 'max_training_size' must be a positive number");
+  }
+  
+  train_opts_t to = parse_train_opts(optim_, num_threads_, opts_);
+  uint32_t optim_shrink_allow = (uint32_t)asInteger(optim_shrink_allow_);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Sizes of all samples.
+  // R_alloc() memory is freed by R at the end of the .Call(), including
+  // when 'sample_size()' raises an error for a file which can't be read
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t *sizes   = (size_t *)R_alloc(n, sizeof(size_t));
+  uint32_t *order = (uint32_t *)R_alloc(n, sizeof(uint32_t));
+  
+  double all_len = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    sizes[i] = sample_size(samples_, i, is_file);
+    order[i] = i;
+    all_len += (double)sizes[i];
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Select samples up to the budget, in a random order (Fisher-Yates) 
+  // if they don't all fit.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (all_len > max_training_size) {
+    shuffle_order(order, n, asInteger(seed_));
+  }
+  
+  size_t total_len = 0;
+  uint32_t nbSamples = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t i = order[k];
+    if ((double)(total_len + sizes[i]) > max_training_size) continue;
+    order[nbSamples++] = i;
+    total_len += sizes[i];
+  }
+  
+  if (nbSamples == 0) {
+    error("zstd_train_dictionary(): No samples fit within 'max_training_size'");
+  }
+  
+  if (total_len < 100 * dictBufferCapacity) {
+    warning("zstd_train_dictionary() ZSTD documentation recommends training data size 100x dictionary size.\nOnly supplied with %.1fx", (double)total_len / (double)dictBufferCapacity);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Allocate.  Freed by R, even on error
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned char *samplesBuffer = (unsigned char *)R_alloc(total_len > 0 ? total_len : 1, 1);
+  size_t *samplesSizes = (size_t *)R_alloc(nbSamples, sizeof(size_t));
+
+  size_t pos = 0;
+  for (uint32_t k = 0; k < nbSamples; k++) {
+    uint32_t i = order[k];
+    samplesSizes[k] = sizes[i];
+    if (!copy_sample(samples_, i, is_file, samplesBuffer + pos, sizes[i])) {
+      error("zstd_train_dictionary(): Couldn't read file '%s'", CHAR(STRING_ELT(samples_, i)));
+    }
+    pos += sizes[i];
+  }
+
+  return train_from_samples(samplesBuffer, samplesSizes, nbSamples, dictBufferCapacity,
+                            optim_shrink_allow, &to);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The training buffer for serialized samples.
+// R objects are serialized directly into this buffer, one after another. 
+// The buffer is doubled (with 'realloc()') when full, as ZDICT needs all 
+// the samples to be contiguous.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  unsigned char *data;
+  size_t capacity;
+  size_t pos;
+} training_buffer_t;
+
+
+static void write_byte_to_training_buffer(R_outpstream_t stream, int c) {
+  error("write_byte_to_training_buffer(): This function unused in binary serialization.");
+}
+
+
+static void write_bytes_to_training_buffer(R_outpstream_t stream, void *src, int length) {
+  training_buffer_t *buf = (training_buffer_t *)stream->data;
+  size_t len = (size_t)length;
+  
+  if (buf->pos + len > buf->capacity) {
+    size_t capacity = buf->capacity;
+    while (buf->pos + len > capacity) {
+      capacity *= 2;
+    }
+    unsigned char *data = (unsigned char *)realloc(buf->data, capacity);
+    if (data == NULL) {
+      error("zstd_train_dictionary(): Could not allocate %zu bytes for 'samplesBuffer'", capacity);
+    }
+    buf->data     = data;
+    buf->capacity = capacity;
+  }
+  
+  memcpy(buf->data + buf->pos, src, len);
+  buf->pos += len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize samples (in the given order) into the training buffer.
+// A sample which takes the buffer over 'max_training_size' is 
+// discarded by rewinding the buffer, and '*skipped' is set.
+//
+// @return number of samples in the buffer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint32_t serialize_samples(SEXP samples_, uint32_t *order, uint32_t n, double max_training_size,
+                                  training_buffer_t *buf, size_t *samplesSizes, int *skipped) {
+  
+  struct R_outpstream_st output_stream;
+  R_InitOutPStream(
+    &output_stream,                 // The stream object which wraps everything
+    (R_pstream_data_t) buf,         // The actual data
+    R_pstream_binary_format,        // Store as binary
+    3,                              // Version = 3 for R >3.5.0 See `?base::serialize`
+    write_byte_to_training_buffer,  // Function to write single byte to buffer
+    write_bytes_to_training_buffer, // Function for writing multiple bytes to buffer
+    NULL,                           // Func for special handling of reference data.
+    R_NilValue                      // Data related to reference data handling
+  );
+  
+  buf->pos = 0;
+  *skipped = 0;
+  uint32_t nbSamples = 0;
+  
+  for (uint32_t k = 0; k < n; k++) {
+    size_t start = buf->pos;
+    R_Serialize(VECTOR_ELT(samples_, order[k]), &output_stream);
+    
+    if ((double)buf->pos > max_training_size) {
+      buf->pos = start;
+      *skipped = 1;
+      continue;
+    }
+    samplesSizes[nbSamples++] = buf->pos - start;
+  }
+  
+  return nbSamples;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Put all 'n' samples (serialized in the given order) back into their
+// original order in a new buffer.  This is only a copy of bytes which
+// have already been serialized.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void unshuffle_samples(training_buffer_t *buf, uint32_t *order, uint32_t n, size_t *samplesSizes) {
+  size_t *offsets = (size_t *)R_alloc(n, sizeof(size_t));
+  size_t *sizes   = (size_t *)R_alloc(n, sizeof(size_t));
+  
+  size_t pos = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    offsets[order[k]] = pos;
+    sizes[order[k]]   = samplesSizes[k];
+    pos += samplesSizes[k];
+  }
+  
+  unsigned char *data = (unsigned char *)malloc(buf->pos > 0 ? buf->pos : 1);
+  if (data == NULL) {
+    error("zstd_train_dictionary(): Could not allocate %zu bytes for 'samplesBuffer'", buf->pos);
+  }
+  
+  pos = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    memcpy(data + pos, buf->data + offsets[i], sizes[i]);
+    samplesSizes[i] = sizes[i];
+    pos += sizes[i];
+  }
+  
+  free(buf->data);
+  buf->data     = data;
+  buf->capacity = buf->pos > 0 ? buf->pos : 1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Everything needed to serialize the samples and train on them.
+// Run via 'R_ExecWithCleanup()' so the training buffer is freed even if
+// 'R_Serialize()' (or anything else) raises an R error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP samples_;
+  uint32_t n;
+  uint32_t *order;
+  int shuffled;
+  double max_training_size;
+  training_buffer_t buf;
+  size_t *samplesSizes;
+  size_t dictBufferCapacity;
+  uint32_t optim_shrink_allow;
+  train_opts_t *to;
+} serialize_training_t;
+
 
+static SEXP serialize_and_train(void *data) {
+  serialize_training_t *st = (serialize_training_t *)data;
+  
+  int skipped;
+  uint32_t nbSamples = serialize_samples(st->samples_, st->order, st->n, st->max_training_size,
+                                         &st->buf, st->samplesSizes, &skipped);
+  
+  if (nbSamples == 0) {
+    error("zstd_train_dictionary(): No samples fit within 'max_training_size'");
+  }
+  
+  // Everything fit, so use the original order, as 'zstd_train_dictionary_()' does
+  if (st->shuffled && !skipped) {
+    unshuffle_samples(&st->buf, st->order, st->n, st->samplesSizes);
+  }
+  
+  return train_from_samples(st->buf.data, st->samplesSizes, nbSamples, st->dictBufferCapacity,
+                            st->optim_shrink_allow, st->to);
+}
 
 
+static void serialize_training_cleanup(void *data) {
+  serialize_training_t *st = (serialize_training_t *)data;
+  free(st->buf.data);
+  st->buf.data = NULL;
+}
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Train a dictionary for R objects serialized with 'zstd_serialize()'.
+//
+// Each object is serialized straight into the training buffer, so no 
+// intermediate R raw vectors are created.
+//
+// Sample selection matches 'zstd_train_dictionary_()' given the serialized
+// samples: all samples are used if they fit in 'max_training_size', 
+// otherwise samples are taken in a (seeded) random order.  As serialized 
+// sizes are not known in advance, when 'max_training_size' is set the
+// samples are serialized (once) in the random order, and if they all fit
+// the serialized bytes are copied back into the original order.
+//
+// @param samples_ list of R objects
+// Other arguments as for 'zstd_train_dictionary_()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_train_dictionary_serialize_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_,
+                                      SEXP max_training_size_, SEXP seed_, SEXP num_threads_, SEXP opts_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack and sanity check args
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!isNewList(samples_)) {
+    error("zstd_train_dictionary(): samples must be provided as a list of R objects");
+  }
+  
+  size_t dictBufferCapacity = (size_t)asInteger(size_);
+  uint32_t n = (uint32_t)length(samples_);
+  
+  if (n == 0) {
+    error("zstd_train_dictionary(): No samples provided");
+  }
+  
+  double max_training_size = isNull(max_training_size_) ? R_PosInf : asReal(max_training_size_);
+  if (ISNAN(max_training_size) || max_training_size <= 0) {
+    error("zstd_train_dictionary(): 'max_training_size' must be a positive number");
+  }
+  
+  train_opts_t to = parse_train_opts(optim_, num_threads_, opts_);
+  uint32_t optim_shrink_allow = (uint32_t)asInteger(optim_shrink_allow_);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Allocate.  The sample order and sizes are freed by R, even on error.
+  // The training buffer is freed by 'serialize_training_cleanup()'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  serialize_training_t st = {
+    .samples_           = samples_,
+    .n                  = n,
+    .order              = (uint32_t *)R_alloc(n, sizeof(uint32_t)),
+    .shuffled           = R_FINITE(max_training_size),
+    .max_training_size  = max_training_size,
+    .samplesSizes       = (size_t *)R_alloc(n, sizeof(size_t)),
+    .dictBufferCapacity = dictBufferCapacity,
+    .optim_shrink_allow = optim_shrink_allow,
+    .to                 = &to
+  };
+  for (uint32_t i = 0; i < n; i++) {
+    st.order[i] = i;
+  }
+  if (st.shuffled) {
+    shuffle_order(st.order, n, asInteger(seed_));
+  }
+  
+  st.buf.capacity = 1024 * 1024;
+  st.buf.pos      = 0;
+  st.buf.data     = (unsigned char *)malloc(st.buf.capacity);
+  if (st.buf.data == NULL) {
+    error("zstd_train_dictionary(): Could not allocate memory for %u samples", n);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Serialize and train.  Warn afterwards so the buffer is never leaked if 
+  // warnings are turned into errors.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP dict_ = PROTECT(R_ExecWithCleanup(serialize_and_train, &st, serialize_training_cleanup, &st));
+  size_t total_len = st.buf.pos;
+  
+  if (total_len < 100 * dictBufferCapacity) {
+    warning("zstd_train_dictionary() ZSTD documentation recommends training data size 100x dictionary size.\nOnly supplied with %.1fx", (double)total_len / (double)dictBufferCapacity);
+  }
+  
+  UNPROTECT(1);
+  return dict_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Evaluate a dictionary on a set of (held-out) samples.
+//
+// Each sample is compressed as its own frame at each level, then 
+// decompressed and checked against the original.
+// One compression context and one decompression context are re-used for 
+// all samples, and the dictionary is digested once per level (and once for
+// decompression) outside of the timed sections, so the timings reflect the 
+// steady-state cost of compressing with an already loaded dictionary.
+//
+// @param dict_ raw vector or filename of a zstd dictionary. NULL to 
+//        evaluate compression without a dictionary (as a baseline)
+// @param samples_ list of raw vectors or strings
+// @param levels_ integer vector of compression levels
+//
+// @return list of equal-length vectors (one element per level)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_dict_evaluate_(SEXP dict_, SEXP samples_, SEXP levels_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack samples
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!isNewList(samples_)) {
+    error("zstd_dict_evaluate(): samples must be a list of raw vectors or character strings");
+  }
+  R_xlen_t n = xlength(samples_);
+  if (n == 0) {
+    error("zstd_dict_evaluate(): No samples provided");
+  }
+  
+  const void **srcs   = (const void **)R_alloc((size_t)n, sizeof(void *));
+  size_t *src_sizes   = (size_t *)R_alloc((size_t)n, sizeof(size_t));
+  size_t total_len    = 0;
+  size_t total_bound  = 0;
+  
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP elem_ = VECTOR_ELT(samples_, i);
+    if (TYPEOF(elem_) == RAWSXP) {
+      srcs[i]      = RAW(elem_);
+      src_sizes[i] = (size_t)xlength(elem_);
+    } else if (TYPEOF(elem_) == STRSXP && length(elem_) == 1) {
+      srcs[i]      = CHAR(STRING_ELT(elem_, 0));
+      src_sizes[i] = strlen(CHAR(STRING_ELT(elem_, 0)));
+    } else {
+      error("zstd_dict_evaluate(): samples must be a list of raw vectors or single strings");
+    }
+    total_len   += src_sizes[i];
+    total_bound += ZSTD_compressBound(src_sizes[i]);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack dictionary
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const void *dict = NULL;
+  size_t dict_size = 0;
+  if (TYPEOF(dict_) == RAWSXP) {
+    dict      = RAW(dict_);
+    dict_size = (size_t)xlength(dict_);
+  } else if (TYPEOF(dict_) == STRSXP) {
+    unsigned char *buf = read_file(CHAR(STRING_ELT(dict_, 0)), &dict_size);
+    dict = R_alloc(dict_size > 0 ? dict_size : 1, 1);
+    memcpy((void *)dict, buf, dict_size);
+    free(buf);
+  } else if (!isNull(dict_)) {
+    error("zstd_dict_evaluate(): 'dict' must be a raw vector, a filename or NULL");
+  }
+  
+  int nlevels = length(levels_);
+  SEXP ilevels_ = PROTECT(coerceVector(levels_, INTSXP));
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Result columns
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define NEVAL 6
+  SEXP res_ = PROTECT(allocVector(VECSXP, NEVAL));
+  SEXP nms_ = PROTECT(allocVector(STRSXP, NEVAL));
+  const char *nms[NEVAL] = {
+    "level", "uncompressed_size", "compressed_size", "ratio", 
+    "compress_mbps", "decompress_mbps"
+  };
+  for (int j = 0; j < NEVAL; j++) {
+    SET_STRING_ELT(nms_, j, mkChar(nms[j]));
+    SET_VECTOR_ELT(res_, j, allocVector(j == 0 ? INTSXP : REALSXP, nlevels));
+  }
+  setAttrib(res_, R_NamesSymbol, nms_);
+  
+  int    *level_col = INTEGER(VECTOR_ELT(res_, 0));
+  double *usize_col = REAL(VECTOR_ELT(res_, 1));
+  double *csize_col = REAL(VECTOR_ELT(res_, 2));
+  double *ratio_col = REAL(VECTOR_ELT(res_, 3));
+  double *cmbps_col = REAL(VECTOR_ELT(res_, 4));
+  double *dmbps_col = REAL(VECTOR_ELT(res_, 5));
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Contexts and buffers are shared by all levels.
+  // Compressed frames are kept end-to-end in 'dst' for the decompression pass
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned char *dst  = (unsigned char *)R_alloc(total_bound, 1);
+  unsigned char *out  = (unsigned char *)R_alloc(total_len > 0 ? total_len : 1, 1);
+  size_t *dst_sizes   = (size_t *)R_alloc((size_t)n, sizeof(size_t));
+  
+  ZSTD_CCtx *cctx  = ZSTD_createCCtx();
+  ZSTD_DCtx *dctx  = ZSTD_createDCtx();
+  ZSTD_DDict *ddict = dict == NULL ? NULL : ZSTD_createDDict(dict, dict_size);
+  if (cctx == NULL || dctx == NULL || (dict != NULL && ddict == NULL)) {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeDDict(ddict);
+    error("zstd_dict_evaluate(): Couldn't initialise contexts or dictionary");
+  }
+  
+  for (int j = 0; j < nlevels; j++) {
+    int level = INTEGER(ilevels_)[j];
+    level = level < -5 ? -5 : level;
+    level = level > 22 ? 22 : level;
+    
+    ZSTD_CDict *cdict = dict == NULL ? NULL : ZSTD_createCDict(dict, dict_size, level);
+    if (dict != NULL && cdict == NULL) {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+      ZSTD_freeDDict(ddict);
+      error("zstd_dict_evaluate(): Couldn't load dictionary at level %i", level);
+    }
+    
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Compress
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    size_t pos = 0;
+    size_t err = 0;
+    double start = monotonic_seconds();
+    for (R_xlen_t i = 0; i < n; i++) {
+      size_t res = cdict == NULL ?
+        ZSTD_compressCCtx(cctx, dst + pos, total_bound - pos, srcs[i], src_sizes[i], level) :
+        ZSTD_compress_usingCDict(cctx, dst + pos, total_bound - pos, srcs[i], src_sizes[i], cdict);
+      if (ZSTD_isError(res)) {
+        err = res;
+        break;
+      }
+      dst_sizes[i] = res;
+      pos += res;
+    }
+    double ctime = monotonic_seconds() - start;
+    ZSTD_freeCDict(cdict);
+    
+    if (err) {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+      ZSTD_freeDDict(ddict);
+      error("zstd_dict_evaluate(): Compression error. %s", ZSTD_getErrorName(err));
+    }
+    
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Decompress
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    size_t out_pos = 0;
+    pos = 0;
+    start = monotonic_seconds();
+    for (R_xlen_t i = 0; i < n; i++) {
+      size_t res = ddict == NULL ?
+        ZSTD_decompressDCtx(dctx, out + out_pos, total_len - out_pos, dst + pos, dst_sizes[i]) :
+        ZSTD_decompress_usingDDict(dctx, out + out_pos, total_len - out_pos, dst + pos, dst_sizes[i], ddict);
+      if (ZSTD_isError(res)) {
+        err = res;
+        break;
+      }
+      pos     += dst_sizes[i];
+      out_pos += res;
+    }
+    double dtime = monotonic_seconds() - start;
+    
+    // Check the round trip outside the timed section
+    int mismatch = !err && out_pos != total_len;
+    out_pos = 0;
+    for (R_xlen_t i = 0; i < n && !err && !mismatch; i++) {
+      mismatch = memcmp(out + out_pos, srcs[i], src_sizes[i]) != 0;
+      out_pos += src_sizes[i];
+    }
+    
+    if (err || mismatch) {
+      ZSTD_freeCCtx(cctx);
+      ZSTD_freeDCtx(dctx);
+      ZSTD_freeDDict(ddict);
+      if (mismatch) {
+        error("zstd_dict_evaluate(): Decompressed data does not match the original");
+      }
+      error("zstd_dict_evaluate(): Decompression error. %s", ZSTD_getErrorName(err));
+    }
+    
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Record. Throughput is in terms of uncompressed bytes
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    level_col[j] = level;
+    usize_col[j] = (double)total_len;
+    csize_col[j] = (double)pos;
+    ratio_col[j] = pos > 0 ? (double)total_len / (double)pos : NA_REAL;
+    cmbps_col[j] = ctime > 0 ? (double)total_len / 1e6 / ctime : NA_REAL;
+    dmbps_col[j] = dtime > 0 ? (double)total_len / 1e6 / dtime : NA_REAL;
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Tidy and return
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  ZSTD_freeCCtx(cctx);
+  ZSTD_freeDCtx(dctx);
+  ZSTD_freeDDict(ddict);
+  UNPROTECT(3);
+  return res_;
+}
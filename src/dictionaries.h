@@ -1,2 +1,3 @@
 SEXP zstd_dict_id_(SEXP src_);
+SEXP zstd_dict_evaluate_(SEXP dict_, SEXP samples_, SEXP levels_);
 
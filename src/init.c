@@ -7,11 +7,18 @@ extern SEXP zstd_version_(void);
 extern SEXP init_cctx_(SEXP opts_);
 extern SEXP init_dctx_(SEXP opts_);
 
+extern SEXP init_cdict_(SEXP dict_, SEXP level_, SEXP dedicated_search_);
+extern SEXP init_ddict_(SEXP dict_);
+
+extern SEXP zstd_dict_register_(SEXP dict_);
+extern SEXP zstd_dict_unregister_(SEXP ids_);
+extern SEXP zstd_dict_registered_(void);
+
 extern SEXP get_cctx_settings_(SEXP cctx_);
 extern SEXP get_dctx_settings_(SEXP dctx_);
 
-extern SEXP zstd_compress_(SEXP src_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_);
-extern SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_);
+extern SEXP zstd_compress_(SEXP src_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_, SEXP each_);
+extern SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_, SEXP offset_, SEXP length_);
 
 extern SEXP zstd_compress_stream_file_(SEXP robj_, SEXP file_, SEXP cctx_, SEXP opts_);
 extern SEXP zstd_decompress_stream_file_(SEXP raw_vec_, SEXP type_, SEXP dctx_, SEXP opts_);
@@ -31,13 +38,19 @@ extern SEXP zstd_unserialize_conn_(SEXP conn_, SEXP dctx_, SEXP opts_);
 extern SEXP zstd_serialize_stream_(SEXP robj_, SEXP cctx_, SEXP opts_);
 extern SEXP zstd_unserialize_stream_(SEXP raw_vec_, SEXP dctx_, SEXP opts_);
 
-extern SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_);
+extern SEXP zstd_train_dictionary_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_, SEXP max_training_size_, SEXP seed_, SEXP num_threads_, SEXP opts_);
+extern SEXP zstd_train_dictionary_serialize_(SEXP samples_, SEXP size_, SEXP optim_, SEXP optim_shrink_allow_, SEXP max_training_size_, SEXP seed_, SEXP num_threads_, SEXP opts_);
 extern SEXP zstd_dict_id_(SEXP dict_);
+extern SEXP zstd_dict_evaluate_(SEXP dict_, SEXP samples_, SEXP levels_);
 
 
-extern SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_);
+extern SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_, SEXP index_);
   
 extern SEXP zstd_info_(SEXP src_);
+extern SEXP zstd_index_(SEXP src_, SEXP dst_);
+extern SEXP zstd_read_lines_(SEXP src_, SEXP n_, SEXP skip_, SEXP dctx_, SEXP opts_);
+
+extern SEXP calc_serialized_size_(SEXP robj_);
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // .C      R_CMethodDef
@@ -47,12 +60,14 @@ static const R_CallMethodDef CEntries[] = {
   {"zstd_version_"                , (DL_FUNC) &zstd_version_                , 0},
   {"init_cctx_"                   , (DL_FUNC) &init_cctx_                   , 1},
   {"init_dctx_"                   , (DL_FUNC) &init_dctx_                   , 1},
+  {"init_cdict_"                  , (DL_FUNC) &init_cdict_                  , 3},
+  {"init_ddict_"                  , (DL_FUNC) &init_ddict_                  , 1},
   
   {"get_cctx_settings_"           , (DL_FUNC) &get_cctx_settings_           , 1},
   {"get_dctx_settings_"           , (DL_FUNC) &get_dctx_settings_           , 1},
   
-  {"zstd_compress_"               , (DL_FUNC) &zstd_compress_               , 5},
-  {"zstd_decompress_"             , (DL_FUNC) &zstd_decompress_             , 5},
+  {"zstd_compress_"               , (DL_FUNC) &zstd_compress_               , 6},
+  {"zstd_decompress_"             , (DL_FUNC) &zstd_decompress_             , 7},
   
   {"zstd_compress_stream_file_"   , (DL_FUNC) &zstd_compress_stream_file_   , 4},
   {"zstd_decompress_stream_file_" , (DL_FUNC) &zstd_decompress_stream_file_ , 4},
@@ -72,11 +87,20 @@ static const R_CallMethodDef CEntries[] = {
   {"zstd_serialize_stream_"       , (DL_FUNC) &zstd_serialize_stream_       , 3},
   {"zstd_unserialize_stream_"     , (DL_FUNC) &zstd_unserialize_stream_     , 3},
   
-  {"zstd_train_dictionary_"       , (DL_FUNC) &zstd_train_dictionary_       , 4},
+  {"zstd_train_dictionary_"       , (DL_FUNC) &zstd_train_dictionary_       , 8},
+  {"zstd_train_dictionary_serialize_", (DL_FUNC) &zstd_train_dictionary_serialize_, 8},
   {"zstd_dict_id_"                , (DL_FUNC) &zstd_dict_id_                , 1},
+  {"zstd_dict_evaluate_"          , (DL_FUNC) &zstd_dict_evaluate_          , 3},
+  {"zstd_dict_register_"          , (DL_FUNC) &zstd_dict_register_          , 1},
+  {"zstd_dict_unregister_"        , (DL_FUNC) &zstd_dict_unregister_        , 1},
+  {"zstd_dict_registered_"        , (DL_FUNC) &zstd_dict_registered_        , 0},
+  
+  {"zstdfile_"       , (DL_FUNC) &zstdfile_       , 6},
+  {"zstd_info_"      , (DL_FUNC) &zstd_info_      , 1},
+  {"zstd_index_"     , (DL_FUNC) &zstd_index_     , 2},
+  {"zstd_read_lines_", (DL_FUNC) &zstd_read_lines_, 5},
   
-  {"zstdfile_" , (DL_FUNC) &zstdfile_ , 5},
-  {"zstd_info_", (DL_FUNC) &zstd_info_, 1},
+  {"calc_serialized_size_", (DL_FUNC) &calc_serialized_size_, 1},
   
   {NULL, NULL, 0}
 };
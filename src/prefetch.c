@@ -0,0 +1,233 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#endif
+
+#include "prefetch.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for reading ahead on a background thread.
+//
+// A worker thread repeatedly calls the user's 'prefetch_fn' (e.g. read
+// and decompress from a file) to fill a ring of 'nblocks' blocks.
+// The R thread copies data out of the ring with 'prefetch_read()', so I/O
+// and decompression overlap with the R thread's own work.
+//
+// The worker waits when all blocks are full, and the reader waits when
+// all blocks are empty.  The worker stops at the end of the data or at the
+// first error.  The error is returned once all data produced before it
+// has been read.
+//
+// Stopping the worker discards any data not yet read.  The state used by
+// 'prefetch_fn' is then ahead of what the reader has consumed.
+//
+// Usage:
+//   p = prefetch_init(8, 131072, fn, data);  // NULL if threads unavailable
+//   n = prefetch_read(p, dst, len, &err);     // Repeat.  n < len at end of data
+//   prefetch_free(p);                         // stop worker
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+#ifndef __EMSCRIPTEN__
+
+struct prefetch_s {
+  prefetch_fn fn;
+  void *data;
+
+  size_t nblocks;
+  size_t block_size;
+  unsigned char **blocks;
+  size_t *lens;        // number of bytes in each block
+
+  size_t head;         // next block to be read by the R thread
+  size_t head_pos;     // read position within the 'head' block
+  size_t tail;         // next block to be filled by the worker
+  size_t count;        // number of filled blocks
+
+  int done;            // Boolean: worker has stopped producing (end of data or error)
+  int quit;            // Boolean: worker should exit
+  size_t err;          // zstd error code from the worker. 0 = no error
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Worker loop: fill empty blocks until the end of data, an error, or quit.
+// This runs outside the main R thread.  No R API calls.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *prefetch_worker(void *arg) {
+  prefetch_t *p = (prefetch_t *)arg;
+
+  pthread_mutex_lock(&p->mutex);
+  while (1) {
+    while (p->count == p->nblocks && !p->quit) {
+      pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    if (p->quit) break;
+
+    // The 'tail' block is not visible to the reader until 'count' increases
+    unsigned char *block = p->blocks[p->tail];
+    pthread_mutex_unlock(&p->mutex);
+    size_t err = 0;
+    size_t n = p->fn(p->data, block, p->block_size, &err);
+    pthread_mutex_lock(&p->mutex);
+
+    if (err || n == 0) {
+      p->err  = err;
+      p->done = 1;
+      pthread_cond_broadcast(&p->cond);
+      break;
+    }
+
+    p->lens[p->tail] = n;
+    p->tail = (p->tail + 1) % p->nblocks;
+    p->count++;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->mutex);
+
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start a worker thread reading ahead with 'fn'.
+// The state used by 'fn' must not be touched by the caller until
+// 'prefetch_free()' has returned
+//
+// @return NULL if the thread could not be started.  Caller should fall back
+//         to reading on the R thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+prefetch_t *prefetch_init(size_t nblocks, size_t block_size, prefetch_fn fn, void *data) {
+  prefetch_t *p = (prefetch_t *)calloc(1, sizeof(prefetch_t));
+  if (p == NULL) return NULL;
+
+  p->fn         = fn;
+  p->data       = data;
+  p->nblocks    = nblocks;
+  p->block_size = block_size;
+  p->blocks     = (unsigned char **)calloc(nblocks, sizeof(unsigned char *));
+  p->lens       = (size_t *)calloc(nblocks, sizeof(size_t));
+  int ok = p->blocks != NULL && p->lens != NULL;
+  for (size_t i = 0; ok && i < nblocks; i++) {
+    p->blocks[i] = (unsigned char *)malloc(block_size);
+    ok = p->blocks[i] != NULL;
+  }
+
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  if (!ok || pthread_create(&p->thread, NULL, prefetch_worker, p) != 0) {
+    p->quit = 1; // Nothing to join
+    prefetch_free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy up to 'len' bytes from the ring into 'dst'.  Waits for the worker
+// when the ring is empty.
+//
+// @return number of bytes copied.  Less than 'len' only at the end of the
+//         data or on error (in which case '*err' is set)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t prefetch_read(prefetch_t *p, void *dst, size_t len, size_t *err) {
+  unsigned char *out = (unsigned char *)dst;
+  size_t total = 0;
+  *err = 0;
+
+  while (total < len) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->count == 0 && !p->done) {
+      pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    if (p->count == 0) {
+      *err = p->err;
+      pthread_mutex_unlock(&p->mutex);
+      break;
+    }
+    unsigned char *block = p->blocks[p->head];
+    size_t block_len = p->lens[p->head];
+    pthread_mutex_unlock(&p->mutex);
+
+    // The 'head' block is not re-used by the worker until 'count' decreases
+    size_t n = block_len - p->head_pos;
+    if (n > len - total) n = len - total;
+    memcpy(out + total, block + p->head_pos, n);
+    total       += n;
+    p->head_pos += n;
+
+    if (p->head_pos == block_len) {
+      pthread_mutex_lock(&p->mutex);
+      p->head     = (p->head + 1) % p->nblocks;
+      p->head_pos = 0;
+      p->count--;
+      pthread_cond_broadcast(&p->cond);
+      pthread_mutex_unlock(&p->mutex);
+    }
+  }
+
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stop the worker and free all memory.  Unread data is discarded.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void prefetch_free(prefetch_t *p) {
+  if (p == NULL) return;
+
+  pthread_mutex_lock(&p->mutex);
+  int started = !p->quit;
+  p->quit = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->mutex);
+
+  if (started) {
+    pthread_join(p->thread, NULL);
+  }
+
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->cond);
+  for (size_t i = 0; p->blocks != NULL && i < p->nblocks; i++) {
+    free(p->blocks[i]);
+  }
+  free(p->blocks);
+  free(p->lens);
+  free(p);
+}
+
+
+#else
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// No threads on Emscripten.  Callers fall back to reading on the R thread
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+prefetch_t *prefetch_init(size_t nblocks, size_t block_size, prefetch_fn fn, void *data) {
+  return NULL;
+}
+
+size_t prefetch_read(prefetch_t *p, void *dst, size_t len, size_t *err) {
+  *err = 0;
+  return 0;
+}
+
+void prefetch_free(prefetch_t *p) {
+}
+
+#endif
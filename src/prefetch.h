@@ -0,0 +1,18 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Produce up to 'capacity' bytes into 'dst'.  Called on the worker thread,
+// and must not call any R API functions.
+// @return number of bytes produced. 0 means there is no more data.
+//         On error, '*err' is set to a zstd error code.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef size_t (*prefetch_fn)(void *data, void *dst, size_t capacity, size_t *err);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read-ahead on a background thread into a ring of blocks
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct prefetch_s prefetch_t;
+
+prefetch_t *prefetch_init(size_t nblocks, size_t block_size, prefetch_fn fn, void *data);
+size_t prefetch_read(prefetch_t *p, void *dst, size_t len, size_t *err);
+void   prefetch_free(prefetch_t *p);
@@ -14,6 +14,8 @@
 #include "zstd/zstd.h"
 #include "calc-size-robust.h"
 #include "dctx.h"
+#include "dict-objects.h"
+#include "buffer-growable.h"
 #include "serialize-file.h"
 
 
@@ -33,7 +35,7 @@ SEXP zstd_decompress_conn_(SEXP conn_, SEXP type_, SEXP dctx_, SEXP opts_) {
   static unsigned char file_buf[INSIZE];
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Create a decompression buffer of the exact required size
+  // Return a raw vector or a string?
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   int return_raw = strcmp(CHAR(STRING_ELT(type_, 0)), "raw") == 0;
   
@@ -46,103 +48,64 @@ SEXP zstd_decompress_conn_(SEXP conn_, SEXP type_, SEXP dctx_, SEXP opts_) {
   } else {
     dctx = init_dctx_with_opts(opts_, 0, 0); // Streaming does NOT have stable buffers
   }
-  
+  dctx_unset_stable_buffers(dctx);
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Allocate the full length buffer to decompress to
+  // Decompress into a buffer which grows as needed.
+  // If the frame header records the uncompressed size, then the buffer
+  // is allocated at exactly this size on the first read.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  SEXP dst_;
-  unsigned char *dst;
-  ZSTD_outBuffer output;
-  
+  growable_buffer_t buf;
+  size_t ret = 0;
   size_t bytes_read;
   int first = 1;
   while ( (bytes_read = R_ReadConnection(rconn, file_buf, INSIZE)) ) {
     
-    // If this is the first read, then 
+    // If this is the first read, then size the output buffer
     if (first) {
-      if (bytes_read < 18) {
-        error("zstd_decompress_conn_(): Could not determine uncompressed size");
+      if (use_dict_registry(dctx_, opts_)) {
+        dctx_select_registered_dict(dctx, file_buf, bytes_read);
       }
-      size_t uncompressed_size = ZSTD_getFrameContentSize(file_buf, 18);
-      
-      // Setup R destination raw vector or string
-      if (return_raw) {
-        dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)uncompressed_size));
-        dst = (void *)RAW(dst_);
-      } else {
-        dst_ = PROTECT(allocVector(STRSXP, 1));
-        dst = (unsigned char *)malloc(uncompressed_size + 1);
-        dst[uncompressed_size] = 0; // Add "\0" terminator to string
-      }  
-      
-      // setup ZSTD output buffer
-      output.dst  = dst;
-      output.size = uncompressed_size;
-      output.pos  = 0;
-      
+      // Invalid data is reported by the decompressor below
+      unsigned long long uncompressed_size = ZSTD_getFrameContentSize(file_buf, bytes_read);
+      init_growable_buffer(&buf, growable_initial_capacity(uncompressed_size, bytes_read));
       first = 0;
     }
     
-    
     ZSTD_inBuffer input = {
       .src  = file_buf,
       .size = bytes_read,
       .pos  = 0
     };
     
-    while (input.pos < input.size) {
-      ZSTD_decompressStream(dctx, &output, &input);
+    ret = decompress_stream_growable(dctx, &buf, &input);
+    if (ZSTD_isError(ret)) {
+      if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+      error("zstd_decompress_conn_(): De-compression error. %s", ZSTD_getErrorName(ret));
     }
   };
   
+  if (first) {
+    if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+    error("zstd_decompress_conn_(): No data read from connection");
+  }
+  
+  ret = decompress_stream_growable_end(dctx, &buf, ret);
+  if (ret != 0) {
+    if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(ret)) {
+      error("zstd_decompress_conn_(): De-compression error. %s", ZSTD_getErrorName(ret));
+    }
+    error("zstd_decompress_conn_(): Compressed data is truncated");
+  }
+  
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+  SEXP dst_ = finish_growable_buffer(&buf, return_raw);
   UNPROTECT(1);
   return dst_;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
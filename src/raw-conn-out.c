@@ -14,14 +14,7 @@
 #include "zstd/zstd.h"
 #include "calc-size-robust.h"
 #include "cctx.h"
-
-
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Magic values calculated with: 
-// Calculated via ZSTD_CStream_InSize()
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-#define INSIZE  131702  
-#define OUTSIZE 131591  
+#include "seekable.h"
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -32,7 +25,6 @@ SEXP zstd_compress_conn_(SEXP vec_, SEXP conn_, SEXP cctx_, SEXP opts_) {
   
   Rconnection rconn = R_GetConnection(conn_);
   
-  static unsigned char zstd_raw[OUTSIZE];
   ZSTD_CCtx *cctx;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -43,14 +35,19 @@ SEXP zstd_compress_conn_(SEXP vec_, SEXP conn_, SEXP cctx_, SEXP opts_) {
   
   if (TYPEOF(vec_) == RAWSXP) {
     src = RAW(vec_);
-    src_size = (size_t)length(vec_);
+    src_size = (size_t)xlength(vec_);
   } else if (TYPEOF(vec_) == STRSXP) {
+    if (xlength(vec_) != 1) {
+      error("zstd_compress(): 'x' must be a single string when writing to a connection");
+    }
     src = (unsigned char *)CHAR(STRING_ELT(vec_, 0));
     src_size = (size_t)strlen(CHAR(STRING_ELT(vec_, 0)));
   } else {
     error("zstd_compress_conn_() only accepts raw vectors or strings");
   }
   
+  size_t frame_size = seekable_frame_size_opt(opts_);
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Initialize the ZSTD context
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -61,56 +58,27 @@ SEXP zstd_compress_conn_(SEXP vec_, SEXP conn_, SEXP cctx_, SEXP opts_) {
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // For streaming compression, need to manually set the 
-  // number of uncompressed bytes
+  // Compress.
+  // The total size is known, so it is pledged and recorded in the frame header.
+  // If 'frame_size' is set, the data is split into independent frames 
+  // followed by a seek table (the zstd seekable format)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t res = ZSTD_CCtx_setPledgedSrcSize(cctx, (unsigned long long)src_size);
-  if (ZSTD_isError(res)) {
-    error("zstd_compress_conn_(): Error on pledge size\n");
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  
+  seekable_writer_t writer;
+  seekable_writer_init(&writer, cctx, frame_size, (unsigned long long)src_size, 
+                       seekable_write_conn, rconn);
+  
+  size_t res = seekable_writer_compress(&writer, src, src_size);
+  if (!ZSTD_isError(res)) {
+    res = seekable_writer_end(&writer);
   }
+  seekable_writer_free(&writer);
   
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Need to flush out and compress any remaining bytes
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  ZSTD_inBuffer input = {
-    input.src  = src,
-    input.size = src_size,
-    input.pos  = 0
-  };
-
-  do {
-    ZSTD_outBuffer output = { 
-      .dst  = zstd_raw, 
-      .size = OUTSIZE, 
-      .pos  = 0 
-    };
-    size_t remaining_bytes = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue);
-    if (ZSTD_isError(remaining_bytes)) {
-      error("zstd_compress_conn_() [mid]: error %s\n", ZSTD_getErrorName(remaining_bytes));
-    }
-    // fwrite(output.dst, 1, output.pos, fp);
-    R_WriteConnection(rconn, output.dst, output.pos);
-  } while(input.pos != input.size);
-    
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Flush remaining
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t remaining_bytes;
-  do {
-    ZSTD_outBuffer output = { 
-      .dst  = zstd_raw, 
-      .size = OUTSIZE, 
-      .pos  = 0 
-    };
-    remaining_bytes = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
-    if (ZSTD_isError(remaining_bytes)) {
-      error("zstd_compress_conn_() [end]: error %s\n", ZSTD_getErrorName(remaining_bytes));
-    }
-    // fwrite(output.dst, 1, output.pos, fp);
-    R_WriteConnection(rconn, output.dst, output.pos);
-  } while (remaining_bytes != 0);
+  if (ZSTD_isError(res)) {
+    if (isNull(cctx_)) ZSTD_freeCCtx(cctx);
+    error("zstd_compress_conn_(): error %s\n", ZSTD_getErrorName(res));
+  }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
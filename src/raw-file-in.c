@@ -13,6 +13,8 @@
 #include "zstd/zstd.h"
 #include "calc-size-robust.h"
 #include "dctx.h"
+#include "dict-objects.h"
+#include "buffer-growable.h"
 #include "serialize-file.h"
 
 
@@ -30,7 +32,7 @@ SEXP zstd_decompress_stream_file_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_)
   static unsigned char file_buf[INSIZE];
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Create a decompression buffer of the exact required size
+  // Return a raw vector or a string?
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   int return_raw = strcmp(CHAR(STRING_ELT(type_, 0)), "raw") == 0;
   
@@ -54,61 +56,67 @@ SEXP zstd_decompress_stream_file_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_)
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Determine uncompressed file size
-  // ZSTD_frameHeaderSize_max = 18
+  // Decompress into a buffer which grows as needed.
+  // If the frame header records the uncompressed size, then the buffer
+  // is allocated at exactly this size on the first read.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t bytes_read = fread(file_buf, 1, 18, fp);
-  fseek(fp, 0, SEEK_SET);  // same as rewind(f); 
-  if (bytes_read != 18) {
-    fclose(fp);
-    error("zstd_decompress_stream_file_(): Couldn't read file '%s' to determine uncompressed size", filename);
-  }
-  size_t uncompressed_size = ZSTD_getFrameContentSize(file_buf, 18);
-  if (ZSTD_isError(uncompressed_size)) {
-    error("zstd_decompress_stream_file_(): Could not determine uncompressed size");
-  }
-  
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Allocate the full length buffer to decompress to
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  SEXP dst_;
-  unsigned char *dst;
-  
-  if (return_raw) {
-    dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)uncompressed_size));
-    dst = (void *)RAW(dst_);
-  } else {
-    dst_ = PROTECT(allocVector(STRSXP, 1));
-    dst = (unsigned char *)malloc(uncompressed_size + 1);
-    dst[uncompressed_size] = 0; // Add "\0" terminator to string
-  }  
-  
-  ZSTD_outBuffer output = {
-    .dst  = dst,
-    .size = uncompressed_size,
-    .pos  = 0
-  };
+  dctx_unset_stable_buffers(dctx);
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
   
+  growable_buffer_t buf;
+  size_t ret = 0;
+  size_t bytes_read;
+  int first = 1;
   
   while ( (bytes_read = fread(file_buf, 1, INSIZE, fp)) ) {
+    
+    if (first) {
+      if (use_dict_registry(dctx_, opts_)) {
+        dctx_select_registered_dict(dctx, file_buf, bytes_read);
+      }
+      // Invalid data is reported by the decompressor below
+      unsigned long long uncompressed_size = ZSTD_getFrameContentSize(file_buf, bytes_read);
+      init_growable_buffer(&buf, growable_initial_capacity(uncompressed_size, bytes_read));
+      first = 0;
+    }
+    
     ZSTD_inBuffer input = {
       .src  = file_buf,
       .size = bytes_read,
       .pos  = 0
     };
     
-    while (input.pos < input.size) {
-      ZSTD_decompressStream(dctx, &output, &input);
+    ret = decompress_stream_growable(dctx, &buf, &input);
+    if (ZSTD_isError(ret)) {
+      fclose(fp);
+      if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+      error("zstd_decompress_stream_file_(): De-compression error. %s", ZSTD_getErrorName(ret));
     }
   };
   
+  if (first) {
+    fclose(fp);
+    if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+    error("zstd_decompress_stream_file_(): Couldn't read data from file '%s'", filename);
+  }
+  
+  ret = decompress_stream_growable_end(dctx, &buf, ret);
+  if (ret != 0) {
+    fclose(fp);
+    if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(ret)) {
+      error("zstd_decompress_stream_file_(): De-compression error. %s", ZSTD_getErrorName(ret));
+    }
+    error("zstd_decompress_stream_file_(): Compressed data is truncated");
+  }
+  
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   fclose(fp);
   if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+  SEXP dst_ = finish_growable_buffer(&buf, return_raw);
   UNPROTECT(1);
   return dst_;
 }
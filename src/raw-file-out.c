@@ -13,24 +13,16 @@
 #include "zstd/zstd.h"
 #include "calc-size-robust.h"
 #include "cctx.h"
+#include "seekable.h"
 #include "raw-file.h"
 
 
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Magic values calculated with: 
-// Calculated via ZSTD_CStream_InSize()
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-#define INSIZE  131702  
-#define OUTSIZE 131591  
-
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Serialize an R object to a buffer of fixed size and then compress
 // the buffer using zstd
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 SEXP zstd_compress_stream_file_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_) {
   
-  static unsigned char zstd_raw[OUTSIZE];
   ZSTD_CCtx *cctx;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -41,7 +33,7 @@ SEXP zstd_compress_stream_file_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_) {
   
   if (TYPEOF(vec_) == RAWSXP) {
     src = RAW(vec_);
-    src_size = (size_t)length(vec_);
+    src_size = (size_t)xlength(vec_);
   } else if (TYPEOF(vec_) == STRSXP) {
     src = (unsigned char *)CHAR(STRING_ELT(vec_, 0));
     src_size = (size_t)strlen(CHAR(STRING_ELT(vec_, 0)));
@@ -49,6 +41,8 @@ SEXP zstd_compress_stream_file_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_) {
     error("zstd_compress() only accepts raw vectors or strings");
   }
   
+  size_t frame_size = seekable_frame_size_opt(opts_);
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Initialize the ZSTD context
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -68,59 +62,35 @@ SEXP zstd_compress_stream_file_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_) {
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // For streaming compression, need to manually set the 
-  // number of uncompressed bytes
+  // Compress.
+  // The total size is known, so it is pledged and recorded in the frame header.
+  // If 'frame_size' is set, the data is split into independent frames 
+  // followed by a seek table (the zstd seekable format)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t res = ZSTD_CCtx_setPledgedSrcSize(cctx, (unsigned long long)src_size);
-  if (ZSTD_isError(res)) {
-    error("zstd_compress_stream_file_(): Error on pledge size\n");
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  
+  seekable_writer_t writer;
+  seekable_writer_init(&writer, cctx, frame_size, (unsigned long long)src_size, 
+                       seekable_write_file, fp);
+  
+  size_t res = seekable_writer_compress(&writer, src, src_size);
+  if (!ZSTD_isError(res)) {
+    res = seekable_writer_end(&writer);
   }
+  seekable_writer_free(&writer);
   
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Need to flush out and compress any remaining bytes
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  ZSTD_inBuffer input = {
-    input.src  = src,
-    input.size = src_size,
-    input.pos  = 0
-  };
-
-  do {
-    ZSTD_outBuffer output = { 
-      .dst  = zstd_raw, 
-      .size = OUTSIZE, 
-      .pos  = 0 
-    };
-    size_t remaining_bytes = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue);
-    if (ZSTD_isError(remaining_bytes)) {
-      error("zstd_compress_stream_file_() [mid]: error %s\n", ZSTD_getErrorName(remaining_bytes));
-    }
-    fwrite(output.dst, 1, output.pos, fp);
-  } while(input.pos != input.size);
-    
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Flush remaining
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t remaining_bytes;
-  do {
-    ZSTD_outBuffer output = { 
-      .dst  = zstd_raw, 
-      .size = OUTSIZE, 
-      .pos  = 0 
-    };
-    remaining_bytes = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
-    if (ZSTD_isError(remaining_bytes)) {
-      error("zstd_compress_stream_file_() [end]: error %s\n", ZSTD_getErrorName(remaining_bytes));
-    }
-    fwrite(output.dst, 1, output.pos, fp);
-  } while (remaining_bytes != 0);
+  if (ZSTD_isError(res)) {
+    fclose(fp);
+    if (isNull(cctx_)) ZSTD_freeCCtx(cctx);
+    error("zstd_compress_stream_file_(): error %s\n", ZSTD_getErrorName(res));
+  }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (isNull(cctx_)) ZSTD_freeCCtx(cctx);
-  fclose(fp);
+  if (fclose(fp) != 0) {
+    error("zstd_compress_stream_file_(): Couldn't write to '%s'", filename);
+  }
   return R_NilValue;
 }
@@ -15,16 +15,48 @@
 #include "calc-size-robust.h"
 #include "cctx.h"
 #include "dctx.h"
+#include "dict-objects.h"
+#include "buffer-growable.h"
+#include "seekable.h"
 #include "utils.h"
 #include "raw-file.h"
+#include "raw-list.h"
+
+#define MAX_RANGE_BYTES 9007199254740992.0 // 2^53
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Serialize an R object to a buffer of fixed size and then compress
 // the buffer using zstd
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_compress_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_) {
+SEXP zstd_compress_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_, 
+                    SEXP each_) {
 
-  if (!isNull(file_) && asLogical(use_file_streaming_)) {
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // A list, or 'each = TRUE', compresses every element into its own frame
+  // and always returns a list
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (TYPEOF(vec_) == VECSXP || asLogical(each_) == TRUE) {
+    if (!isNull(file_)) {
+      error("zstd_compress(): Lists of raw vectors and 'each = TRUE' cannot be written to a file");
+    }
+    if (TYPEOF(vec_) == RAWSXP) {
+      SEXP list_ = PROTECT(allocVector(VECSXP, 1));
+      SET_VECTOR_ELT(list_, 0, vec_);
+      SEXP res_ = PROTECT(zstd_compress_list_(list_, cctx_, opts_));
+      UNPROTECT(2);
+      return res_;
+    } else if (TYPEOF(vec_) != VECSXP && TYPEOF(vec_) != STRSXP) {
+      error("zstd_compress() only accepts raw vectors, lists of raw vectors or strings");
+    }
+    return zstd_compress_list_(vec_, cctx_, opts_);
+  }
+  
+  if (TYPEOF(vec_) == STRSXP && xlength(vec_) != 1) {
+    error("zstd_compress(): 'x' must be a single string. Use 'each = TRUE' to compress each element separately");
+  }
+  
+  // Seekable format is written frame-by-frame by the streaming writer
+  if (!isNull(file_) && (asLogical(use_file_streaming_) || seekable_frame_size_opt(opts_) > 0)) {
     return zstd_compress_stream_file_(vec_, file_, cctx_, opts_);
   }
   
@@ -37,19 +69,20 @@ SEXP zstd_compress_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file
   
   if (TYPEOF(vec_) == RAWSXP) {
     src = RAW(vec_);
-    src_size = (size_t)length(vec_);
+    src_size = (size_t)xlength(vec_);
   } else if (TYPEOF(vec_) == STRSXP) {
     src = (unsigned char *)CHAR(STRING_ELT(vec_, 0));
     src_size = (size_t)strlen(CHAR(STRING_ELT(vec_, 0)));
   } else {
-    error("zstd_compress() only accepts raw vectors or strings");
+    error("zstd_compress() only accepts raw vectors, lists of raw vectors or strings");
   }
   
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // calculate maximum possible size of compressed buffer in the worst case
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t dstCapacity  = (size_t)ZSTD_compressBound(src_size);
+  size_t frame_size   = seekable_frame_size_opt(opts_);
+  size_t dstCapacity  = seekable_compress_bound(src_size, frame_size);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Allocate a raw R vector to hold anything up to this size
@@ -60,18 +93,39 @@ SEXP zstd_compress_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Prepare compression context
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The seekable writer compresses in chunks, so cannot use stable buffers
   ZSTD_CCtx* cctx;
   if (isNull(cctx_)) {
-    cctx = init_cctx_with_opts(opts_, 1, 0); // stable buffers
+    cctx = init_cctx_with_opts(opts_, frame_size == 0, 0);
   } else {
     cctx = external_ptr_to_zstd_cctx(cctx_);
-    cctx_set_stable_buffers(cctx);
+    if (frame_size == 0) cctx_set_stable_buffers(cctx);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Compress data
+  // Compress data.
+  // If 'frame_size' is set, write the seekable format: independent frames
+  // followed by a seek table
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t num_compressed_bytes = ZSTD_compress2(cctx, dst, dstCapacity, src, src_size);
+  size_t num_compressed_bytes;
+  if (frame_size == 0) {
+    num_compressed_bytes = ZSTD_compress2(cctx, dst, dstCapacity, src, src_size);
+  } else {
+    seekable_mem_t mem = { .dst = (unsigned char *)dst, .capacity = dstCapacity, .pos = 0 };
+    seekable_writer_t writer;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    seekable_writer_init(&writer, cctx, frame_size, (unsigned long long)src_size, 
+                         seekable_write_mem, &mem);
+    num_compressed_bytes = seekable_writer_compress(&writer, src, src_size);
+    if (!ZSTD_isError(num_compressed_bytes)) {
+      num_compressed_bytes = seekable_writer_end(&writer);
+    }
+    if (!ZSTD_isError(num_compressed_bytes)) {
+      num_compressed_bytes = mem.pos;
+    }
+    seekable_writer_free(&writer);
+  }
+  
   if (isNull(cctx_)) {
     ZSTD_freeCCtx(cctx);
   } else {
@@ -120,45 +174,330 @@ SEXP zstd_compress_(SEXP vec_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Unpack a raw vector to an R object
+// State for 'zstd_decompress_range_data()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  ZSTD_DCtx *dctx;
+  ZSTD_inBuffer input;
+  growable_buffer_t *buf;
+  uint64_t skip;    // Bytes to discard before the range
+  double length;    // Negative means to the end of the data
+  size_t ret;       // Last return value from ZSTD_decompressStream()
+} range_args_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress the range into the growable buffer.  With 'skip = 0' and
+// 'length = -1' this decompresses all of the input.
+// Called via 'with_dctx()', as growing the buffer may raise an R error.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_) {
+static SEXP zstd_decompress_range_data(void *data) {
+  range_args_t *args     = (range_args_t *)data;
+  ZSTD_DCtx *dctx        = args->dctx;
+  ZSTD_inBuffer *input   = &args->input;
+  growable_buffer_t *buf = args->buf;
+  uint64_t skip          = args->skip;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Unpack data
+  // Discard output up to 'offset'
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned char *src;
-  size_t src_size;
+  size_t ret = 0;
+  if (skip > 0 && input->pos < input->size) {
+    size_t scratch_size = ZSTD_DStreamOutSize();
+    unsigned char *scratch = (unsigned char *)R_alloc(scratch_size, 1); // Freed by R, even on error
+    
+    while (skip > 0) {
+      ZSTD_outBuffer output = {
+        .dst  = scratch,
+        .size = skip < scratch_size ? (size_t)skip : scratch_size,
+        .pos  = 0
+      };
+      ret = ZSTD_decompressStream(dctx, &output, input);
+      if (ZSTD_isError(ret)) break;
+      skip -= output.pos;
+      if (input->pos == input->size && (ret == 0 || output.pos == 0)) break; // End of data
+    }
+  }
   
-  if (TYPEOF(src_) == STRSXP) {
-    if (asLogical(use_file_streaming_)) {
-      return zstd_decompress_stream_file_(src_, type_, dctx_, opts_);
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Output the requested range.  
+  // If the length is known, the buffer grows as needed but the decoder 
+  // is never given room for more than 'length' bytes in total. 
+  // The result is truncated if the data ends before the range does.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!ZSTD_isError(ret) && skip == 0 && input->pos < input->size) {
+    if (args->length < 0) {
+      ret = decompress_stream_growable(dctx, buf, input);
+      if (!ZSTD_isError(ret)) {
+        ret = decompress_stream_growable_end(dctx, buf, ret);
+      }
     } else {
-      src = read_file(CHAR(STRING_ELT(src_, 0)), &src_size);
+      size_t want = (size_t)args->length;
+      while (buf->output.pos < want) {
+        if (buf->output.pos == buf->output.size) {
+          grow_growable_buffer(buf);
+        }
+        ZSTD_outBuffer output = {
+          .dst  = buf->output.dst,
+          .size = buf->output.size < want ? buf->output.size : want,
+          .pos  = buf->output.pos
+        };
+        size_t out_pos = buf->output.pos;
+        ret = ZSTD_decompressStream(dctx, &output, input);
+        if (ZSTD_isError(ret)) break;
+        buf->output.pos = output.pos;
+        if (input->pos == input->size && (ret == 0 || output.pos == out_pos)) break; // End of data
+      }
+      if (buf->output.pos == want) ret = 0;
     }
-  } else if (TYPEOF(src_) == RAWSXP) {
-    src = RAW(src_);
-    src_size = (size_t)length(src_);
+  }
+  
+  args->ret = ret;
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a frame with unknown content size.
+//
+// The output is a raw vector which doubles in capacity whenever it fills.
+// This is a single pass over the compressed data.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_decompress_growable(unsigned char *src, size_t src_size, int return_raw, SEXP dctx_, SEXP opts_) {
+  
+  // Allocated before the decompression context, so an error can't leak it
+  growable_buffer_t buf;
+  init_growable_buffer(&buf, growable_initial_capacity(ZSTD_CONTENTSIZE_UNKNOWN, src_size));
+  
+  int use_registry = use_dict_registry(dctx_, opts_);
+  
+  ZSTD_DCtx *dctx;
+  if (isNull(dctx_)) {
+    dctx = init_dctx_with_opts(opts_, 0, 0); // Output buffer is NOT stable
   } else {
-    error("zstd_compress_() only accepts raw vectors or filenames");
+    dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
+  }
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+  if (use_registry) {
+    dctx_select_registered_dict(dctx, src, src_size);
+  }
+  
+  // Growing the buffer may raise an error, so free an internal context 
+  // via 'with_dctx()'
+  range_args_t args = {
+    .dctx   = dctx,
+    .input  = { .src = src, .size = src_size, .pos = 0 },
+    .buf    = &buf,
+    .skip   = 0,
+    .length = -1,
+    .ret    = 0
+  };
+  with_dctx(zstd_decompress_range_data, &args, dctx, dctx_);
+  
+  size_t ret = args.ret;
+  if (ZSTD_isError(ret)) {
+    error("zstd_decompress_(): De-compression error. %s", ZSTD_getErrorName(ret));
+  } else if (ret != 0) {
+    error("zstd_decompress_(): Compressed data is truncated");
+  }
+  
+  SEXP dst_ = finish_growable_buffer(&buf, return_raw);
+  UNPROTECT(1);
+  return dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Starting capacity for the output of a byte range of known length.
+//
+// 'length' is only an upper bound, so rather than allocating all of it,
+// walk the frame headers from 'c_offset' and stop once they account for 
+// 'length' bytes.  If a frame has no content size, fall back to a guess
+// from the compressed size.  The buffer grows (up to 'length') if needed.
+//
+// @param skip number of bytes in the frame at 'c_offset' before the range
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t range_initial_capacity(unsigned char *src, size_t src_size, size_t c_offset, 
+                                     uint64_t skip, uint64_t length) {
+  uint64_t avail = 0;
+  
+  while (c_offset < src_size && avail < skip + length) {
+    unsigned long long content_size = ZSTD_getFrameContentSize(src + c_offset, src_size - c_offset);
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR) {
+      avail += growable_initial_capacity(ZSTD_CONTENTSIZE_UNKNOWN, src_size - c_offset);
+      break;
+    }
+    
+    size_t c_size = ZSTD_findFrameCompressedSize(src + c_offset, src_size - c_offset);
+    if (ZSTD_isError(c_size)) break;
+    
+    c_offset += c_size;
+    avail    += content_size;
+  }
+  
+  avail = avail > skip ? avail - skip : 0;
+  return (size_t)(avail < length ? avail : length);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress only the bytes in [offset, offset + length).
+//
+// Whole frames before 'offset' are jumped over using the seek table, or
+// the content size in each frame header.  Output before 'offset' in the 
+// first frame which is decoded is discarded.  Decompression stops as soon
+// as 'length' bytes have been produced.
+//
+// @param length number of bytes. Negative means to the end of the data
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_decompress_range(unsigned char *src, size_t src_size, uint64_t offset, double length,
+                                  int return_raw, SEXP dctx_, SEXP opts_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Find the frame containing 'offset'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t   c_offset = 0;
+  uint64_t d_offset = 0;
+  
+  seek_index_t index;
+  seek_index_init(&index);
+  if (seek_index_read_table_mem(&index, src, src_size)) {
+    seek_point_t *point = seek_index_find(&index, offset);
+    c_offset = (size_t)point->c_offset;
+    d_offset = point->d_offset;
+  }
+  seek_index_free(&index);
+  
+  while (c_offset < src_size) {
+    // Skippable frames have a content size of 0 and are always jumped over
+    unsigned long long content_size = ZSTD_getFrameContentSize(src + c_offset, src_size - c_offset);
+    if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || 
+        content_size == ZSTD_CONTENTSIZE_ERROR   ||
+        d_offset + content_size > offset) break;
+    
+    size_t c_size = ZSTD_findFrameCompressedSize(src + c_offset, src_size - c_offset);
+    if (ZSTD_isError(c_size)) break;
+    
+    c_offset += c_size;
+    d_offset += content_size;
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Find the number of bytes of compressed data in the frame
-  // ZSTDLIB_API size_t ZSTD_findFrameCompressedSize(const void* src, size_t srcSize);
+  // Output buffer.  Allocated before the decompression context so that
+  // an allocation failure does not leak the context.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t compressedSize = ZSTD_findFrameCompressedSize(src, src_size);
+  uint64_t skip = offset - d_offset;
+  
+  growable_buffer_t buf;
+  if (length < 0) {
+    init_growable_buffer(&buf, growable_initial_capacity(ZSTD_CONTENTSIZE_UNKNOWN, src_size - c_offset));
+  } else {
+    init_growable_buffer(&buf, range_initial_capacity(src, src_size, c_offset, skip, (uint64_t)length));
+  }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Determine the final decompressed size in number of bytes
+  // Initialise decompression context.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t dstCapacity = ZSTD_getFrameContentSize(src, compressedSize);
+  int use_registry = use_dict_registry(dctx_, opts_);
+  
+  ZSTD_DCtx *dctx;
+  if (isNull(dctx_)) {
+    dctx = init_dctx_with_opts(opts_, 0, 0); // Output buffer is NOT stable
+  } else {
+    dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
+  }
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+  if (use_registry) {
+    dctx_select_registered_dict(dctx, src + c_offset, src_size - c_offset);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompress.  An internal context is freed even if growing the 
+  // output buffer raises an error.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  range_args_t args = {
+    .dctx   = dctx,
+    .input  = { .src = src, .size = src_size, .pos = c_offset },
+    .buf    = &buf,
+    .skip   = skip,
+    .length = length,
+    .ret    = 0
+  };
+  with_dctx(zstd_decompress_range_data, &args, dctx, dctx_);
+  
+  size_t ret = args.ret;
+  if (ZSTD_isError(ret)) {
+    error("zstd_decompress_(): De-compression error. %s", ZSTD_getErrorName(ret));
+  } else if (ret != 0) {
+    error("zstd_decompress_(): Compressed data is truncated");
+  }
+  
+  SEXP dst_ = finish_growable_buffer(&buf, return_raw);
+  UNPROTECT(1);
+  return dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Arguments for 'zstd_decompress_data()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  unsigned char *src;
+  size_t src_size;
+  int return_raw;
+  double offset;
+  double length;   // Negative means to the end of the data
+  SEXP dctx_;
+  SEXP opts_;
+} decompress_args_t;
 
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a raw vector or a mapped file.
+// For a file this is called via 'with_mapped_file()', so the mapping is
+// released even if an R error is raised here.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_decompress_data(void *data) {
+  
+  decompress_args_t *args = (decompress_args_t *)data;
+  unsigned char *src = args->src;
+  size_t src_size    = args->src_size;
+  int return_raw     = args->return_raw;
+  SEXP dctx_         = args->dctx_;
+  SEXP opts_         = args->opts_;
+  
+  // Before finding the total size, as that walks every frame
+  if (args->offset > 0 || args->length >= 0) {
+    return zstd_decompress_range(src, src_size, (uint64_t)args->offset, args->length, 
+                                 return_raw, dctx_, opts_);
+  }
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Create a decompression buffer of the exact required size
+  // Determine the final decompressed size in number of bytes.
+  // The data may be multiple concatenated frames (e.g. a file which has 
+  // been appended to), so walk all the frame headers and sum the sizes.
+  // ZSTDLIB_API unsigned long long ZSTD_findDecompressedSize(const void* src, size_t srcSize);
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int return_raw = strcmp(CHAR(STRING_ELT(type_, 0)), "raw") == 0;
+  unsigned long long contentSize = ZSTD_findDecompressedSize(src, src_size);
+  if (contentSize == ZSTD_CONTENTSIZE_ERROR) {
+    error("zstd_decompress_(): Invalid or truncated zstd compressed data");
+  }
   
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Frames written by a streaming compressor (e.g. 'zstd' reading from a 
+  // pipe) may not record the decompressed size.  If any frame is missing
+  // its size, decompress into a buffer which grows as needed
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+    return zstd_decompress_growable(src, src_size, return_raw, dctx_, opts_);
+  }
+  size_t dstCapacity = (size_t)contentSize;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Create a decompression buffer of the exact required size
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   SEXP dst_;
   unsigned char *dst;
   
@@ -167,7 +506,7 @@ SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_fi
     dst = (void *)RAW(dst_);
   } else {
     dst_ = PROTECT(allocVector(STRSXP, 1));
-    dst = (unsigned char *)malloc(dstCapacity + 1);
+    dst = (unsigned char *)R_alloc(dstCapacity + 1, 1); // Freed by R, even on error
     dst[dstCapacity] = 0; // Add "\0" terminator to string
   }  
 
@@ -183,10 +522,15 @@ SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_fi
     dctx_set_stable_buffers(dctx);
   }
   
+  if (use_dict_registry(dctx_, opts_)) {
+    dctx_select_registered_dict(dctx, src, src_size);
+  }
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Decompress
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t status = ZSTD_decompressDCtx(dctx, dst, dstCapacity, src, compressedSize);
+  size_t status = ZSTD_decompressDCtx(dctx, dst, dstCapacity, src, src_size);
+  if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
   if (ZSTD_isError(status)) {
     error("zstd_decompress_(): De-compression error. %s", ZSTD_getErrorName(status));
   }
@@ -195,17 +539,85 @@ SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_fi
   // Creating string if this was requested
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (!return_raw) {
-    SET_STRING_ELT(dst_, 0, mkChar((char *)dst));
+    int truncated = 0;
+    SET_STRING_ELT(dst_, 0, mkchar_nul_truncated((char *)dst, dstCapacity, "zstd_decompress()", &truncated));
+    if (truncated) {
+      warning("zstd_decompress(): string appears to contain an embedded nul and was truncated");
+    }
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (TYPEOF(src_) == STRSXP) {
-    // We decoded from a file buffer. Free the buffer
-    free(src);
-  }
   UNPROTECT(1);
   return dst_;
 }
 
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack a raw vector to an R object
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_decompress_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_, 
+                      SEXP offset_, SEXP length_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned char *src;
+  size_t src_size;
+  mapped_file_t mf = { 0 };
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Byte range. 'length = NA' means to the end of the data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double offset = asReal(offset_);
+  double length = asReal(length_);
+  if (!R_FINITE(offset) || offset < 0) {
+    error("zstd_decompress_(): 'offset' must be a finite non-negative number");
+  }
+  if (ISNAN(length)) {
+    length = -1;
+  } else if (!R_FINITE(length) || length < 0) {
+    error("zstd_decompress_(): 'length' must be a finite non-negative number or NA");
+  }
+  // Beyond this, doubles no longer represent every byte position exactly
+  if (offset > MAX_RANGE_BYTES) offset = MAX_RANGE_BYTES;
+  if (length > MAX_RANGE_BYTES) length = MAX_RANGE_BYTES;
+  int is_range = offset > 0 || length >= 0;
+  
+  if (TYPEOF(src_) == VECSXP || (TYPEOF(src_) == STRSXP && xlength(src_) > 1)) {
+    if (is_range) {
+      error("zstd_decompress_(): 'offset' and 'length' are not supported for multiple inputs");
+    }
+    return zstd_decompress_list_(src_, type_, dctx_, opts_);
+  } else if (TYPEOF(src_) == STRSXP) {
+    if (asLogical(use_file_streaming_) && !is_range) {
+      return zstd_decompress_stream_file_(src_, type_, dctx_, opts_);
+    } else {
+      map_file(CHAR(STRING_ELT(src_, 0)), &mf);
+      src      = mf.data;
+      src_size = mf.size;
+    }
+  } else if (TYPEOF(src_) == RAWSXP) {
+    src = RAW(src_);
+    src_size = (size_t)xlength(src_);
+  } else {
+    error("zstd_decompress_() only accepts raw vectors, lists of raw vectors or filenames");
+  }
+  
+  decompress_args_t args = {
+    .src        = src,
+    .src_size   = src_size,
+    .return_raw = strcmp(CHAR(STRING_ELT(type_, 0)), "raw") == 0,
+    .offset     = offset,
+    .length     = length,
+    .dctx_      = dctx_,
+    .opts_      = opts_
+  };
+  
+  if (TYPEOF(src_) == STRSXP) {
+    return with_mapped_file(zstd_decompress_data, &args, &mf);
+  }
+  return zstd_decompress_data(&args);
+}
@@ -0,0 +1,494 @@
+
+
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zstd.h"
+#include "cctx.h"
+#include "dctx.h"
+#include "dict-objects.h"
+#include "utils.h"
+#include "raw-list.h"
+#include "threads.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for compressing/decompressing a list of
+// raw vectors (or every element of a character vector) in a single call.
+//
+// A single compression/decompression context is used for all elements (or
+// one per thread when multithreaded), so the cost of the '.Call()' and 
+// context initialisation is paid only once.
+// Each element is compressed into its own independent zstd frame.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Everything the workers need to compress a batch.
+// All R objects are unpacked to plain pointers on the main thread, as 
+// workers cannot use the R API.
+// Elements which are NULL/NA have 'dst[i] == NULL' and are skipped.
+//
+// The arrays are allocated with 'R_alloc()', so are freed by R even on error.
+// Contexts are released by 'compress_batch_cleanup()'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP src_;
+  SEXP cctx_;              // User supplied context. Or R_NilValue
+  SEXP opts_;
+  R_xlen_t n;
+  int num_threads;
+  ZSTD_CCtx **cctxs;       // One context per worker
+  unsigned char **src;
+  size_t *src_size;
+  unsigned char **dst;
+  size_t *dst_capacity;
+  size_t *result;          // Number of compressed bytes, or a zstd error code
+} compress_batch_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress a single element of the batch (called from worker threads)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void compress_batch_item(void *data, int worker, size_t i) {
+  compress_batch_t *b = (compress_batch_t *)data;
+  if (b->dst[i] == NULL) return;
+  b->result[i] = ZSTD_compress2(b->cctxs[worker], b->dst[i], b->dst_capacity[i], b->src[i], b->src_size[i]);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free the internal contexts.  
+// Called by 'R_ExecWithCleanup()' on success and on error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void compress_batch_cleanup(void *data) {
+  compress_batch_t *b = (compress_batch_t *)data;
+  
+  if (isNull(b->cctx_)) {
+    for (int t = 0; t < b->num_threads; t++) {
+      ZSTD_freeCCtx(b->cctxs[t]);
+      b->cctxs[t] = NULL;
+    }
+  } else if (b->cctxs[0] != NULL) {
+    // Resetting first means unsetting the parameters can't fail
+    ZSTD_CCtx_reset(b->cctxs[0], ZSTD_reset_session_only);
+    cctx_unset_stable_buffers(b->cctxs[0]);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The body of 'zstd_compress_list_()'.
+// Run via 'R_ExecWithCleanup()' so that an R error (including a failed 
+// R allocation) still frees every context.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP compress_batch(void *data) {
+  compress_batch_t *b = (compress_batch_t *)data;
+  R_xlen_t n = b->n;
+  int is_string = TYPEOF(b->src_) == STRSXP;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Prepare compression contexts. One per thread.
+  // Done first, so that bad options are reported before the (possibly 
+  // large) output is allocated
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (isNull(b->cctx_)) {
+    for (int t = 0; t < b->num_threads; t++) {
+      b->cctxs[t] = init_cctx_with_opts(b->opts_, 1, t > 0); // stable buffers
+      if (b->num_threads > 1) {
+        ZSTD_CCtx_setParameter(b->cctxs[t], ZSTD_c_nbWorkers, 0);
+      }
+    }
+  } else {
+    ZSTD_CCtx *cctx = external_ptr_to_zstd_cctx(b->cctx_);
+    cctx_set_stable_buffers(cctx);
+    b->cctxs[0] = cctx;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Unpack each element and allocate the worst case size directly in the
+  // result list.  These are truncated after compression.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP dst_ = PROTECT(allocVector(VECSXP, n));
+
+  for (R_xlen_t i = 0; i < n; i++) {
+    b->dst[i] = NULL;
+    
+    if (is_string) {
+      SEXP elem_ = STRING_ELT(b->src_, i);
+      if (elem_ == NA_STRING) continue;
+      b->src[i] = (unsigned char *)CHAR(elem_);
+      b->src_size[i] = (size_t)LENGTH(elem_);
+    } else {
+      SEXP elem_ = VECTOR_ELT(b->src_, i);
+      if (isNull(elem_)) continue;
+      b->src[i] = RAW(elem_);
+      b->src_size[i] = (size_t)xlength(elem_);
+    }
+
+    b->dst_capacity[i] = ZSTD_compressBound(b->src_size[i]);
+    SEXP frame_ = allocVector(RAWSXP, (R_xlen_t)b->dst_capacity[i]);
+    SET_VECTOR_ELT(dst_, i, frame_);
+    b->dst[i] = RAW(frame_);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compress all elements
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  run_batch((size_t)n, b->num_threads, compress_batch_item, b);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Check for errors and truncate the user-viewable size of each RAW vector
+  // Requires: R_VERSION >= R_Version(3, 4, 0)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (b->dst[i] == NULL) continue;
+    
+    size_t num_compressed_bytes = b->result[i];
+    if (ZSTD_isError(num_compressed_bytes)) {
+      error("zstd_compress(): Compression error on element %.0f. %s", (double)(i + 1),
+            ZSTD_getErrorName(num_compressed_bytes));
+    }
+    
+    if (num_compressed_bytes < b->dst_capacity[i]) {
+      SEXP frame_ = VECTOR_ELT(dst_, i);
+      SETLENGTH(frame_, (R_xlen_t)num_compressed_bytes);
+      SET_TRUELENGTH(frame_, (R_xlen_t)b->dst_capacity[i]);
+      SET_GROWABLE_BIT(frame_);
+    }
+  }
+
+  UNPROTECT(1);
+  return dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress a list of raw vectors, or each string in a character vector.
+// Returns a list of compressed raw vectors. 
+// NULL list elements and NA strings are returned as NULL.
+//
+// If no user context is given and 'num_threads > 1', the elements are 
+// spread across a pool of threads, each with its own context.  
+// zstd's own multithreading within a frame is then disabled, as the 
+// threads are better used working on independent elements.
+// A user supplied context cannot be shared between threads, so is always
+// used from the calling thread only.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_compress_list_(SEXP src_, SEXP cctx_, SEXP opts_) {
+
+  R_xlen_t n = xlength(src_);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Check all elements before allocating anything
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (TYPEOF(src_) != STRSXP) {
+    for (R_xlen_t i = 0; i < n; i++) {
+      SEXP elem_ = VECTOR_ELT(src_, i);
+      if (!isNull(elem_) && TYPEOF(elem_) != RAWSXP) {
+        error("zstd_compress(): List element %.0f is not a raw vector", (double)(i + 1));
+      }
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Allocate batch arrays.  Freed by R, even on error
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t nalloc = n > 0 ? (size_t)n : 1;
+  int num_threads = isNull(cctx_) ? batch_num_threads(opts_, (size_t)n) : 1;
+  compress_batch_t b = {
+    .src_         = src_,
+    .cctx_        = cctx_,
+    .opts_        = opts_,
+    .n            = n,
+    .num_threads  = num_threads,
+    .cctxs        = (ZSTD_CCtx **)R_alloc((size_t)num_threads, sizeof(ZSTD_CCtx *)),
+    .src          = (unsigned char **)R_alloc(nalloc, sizeof(unsigned char *)),
+    .src_size     = (size_t *)R_alloc(nalloc, sizeof(size_t)),
+    .dst          = (unsigned char **)R_alloc(nalloc, sizeof(unsigned char *)),
+    .dst_capacity = (size_t *)R_alloc(nalloc, sizeof(size_t)),
+    .result       = (size_t *)R_alloc(nalloc, sizeof(size_t))
+  };
+  memset(b.cctxs, 0, (size_t)num_threads * sizeof(ZSTD_CCtx *));
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compress, then release all contexts
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  return R_ExecWithCleanup(compress_batch, &b, compress_batch_cleanup, &b);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Everything the workers need to decompress a batch.
+// Sources are either in-memory raw vectors or files which are memory-mapped
+// on the main thread ('files').  Either way, 'src' points to the data.
+// Elements which are NULL have 'dst[i] == NULL' and are skipped.
+//
+// The arrays are allocated with 'R_alloc()', so are freed by R even on error.
+// Contexts and mappings are released by 'decompress_batch_cleanup()'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP src_;
+  SEXP dst_;
+  SEXP dctx_;              // User supplied context. Or R_NilValue
+  SEXP opts_;
+  R_xlen_t n;
+  int return_raw;
+  int num_threads;
+  R_xlen_t nul_elem;       // First string truncated at a nul. 0 = none
+  ZSTD_DCtx **dctxs;       // One context per worker
+  mapped_file_t *files;    // NULL if decompressing from memory
+  size_t nfiles;           // Number of files mapped so far
+  unsigned char **src;
+  size_t *src_size;
+  unsigned char **dst;
+  size_t *dst_capacity;
+  size_t *result;          // zstd error code or decompressed size
+  int use_registry;        // Select each element's dictionary from the registry?
+} decompress_batch_t;
+
+#define NULL_ELEMENT ((size_t)-1)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a single element of the batch (called from worker threads)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void decompress_batch_item(void *data, int worker, size_t i) {
+  decompress_batch_t *b = (decompress_batch_t *)data;
+  if (b->dst[i] == NULL) return;
+  
+  if (b->use_registry) {
+    dctx_select_registered_dict(b->dctxs[worker], b->src[i], b->src_size[i]);
+  }
+  
+  // All frames are decompressed into one contiguous output
+  b->result[i] = ZSTD_decompressDCtx(b->dctxs[worker], b->dst[i], b->dst_capacity[i], 
+                                     b->src[i], b->src_size[i]);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unmap any files and free the internal contexts.  
+// Called by 'R_ExecWithCleanup()' on success and on error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void decompress_batch_cleanup(void *data) {
+  decompress_batch_t *b = (decompress_batch_t *)data;
+  
+  for (size_t i = 0; i < b->nfiles; i++) {
+    unmap_file(&b->files[i]);
+  }
+  b->nfiles = 0;
+  
+  if (isNull(b->dctx_)) {
+    for (int t = 0; t < b->num_threads; t++) {
+      ZSTD_freeDCtx(b->dctxs[t]);
+      b->dctxs[t] = NULL;
+    }
+  } else if (b->dctxs[0] != NULL) {
+    // Resetting first means unsetting the parameter can't fail
+    ZSTD_DCtx_reset(b->dctxs[0], ZSTD_reset_session_only);
+    dctx_unset_stable_buffers(b->dctxs[0]);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The body of 'zstd_decompress_list_()'.
+// Run via 'R_ExecWithCleanup()' so that an R error (including a failed 
+// R allocation) still releases every mapping and context.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP decompress_batch(void *data) {
+  decompress_batch_t *b = (decompress_batch_t *)data;
+  R_xlen_t n = b->n;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Initialise decompression contexts. One per thread.
+  // Done first, so that bad options are reported before any file is mapped
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (isNull(b->dctx_)) {
+    for (int t = 0; t < b->num_threads; t++) {
+      b->dctxs[t] = init_dctx_with_opts(b->opts_, 1, t > 0); // stable buffers
+    }
+    b->use_registry = use_dict_registry(b->dctx_, b->opts_);
+  } else {
+    ZSTD_DCtx *dctx = external_ptr_to_zstd_dctx(b->dctx_);
+    dctx_set_stable_buffers(dctx);
+    b->dctxs[0] = dctx;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Find the decompressed size of each element.
+  // The size is the sum over all frames, so every frame must record 
+  // its content size.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t total_size = 0;
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (b->files != NULL) {
+      const char *filename = CHAR(STRING_ELT(b->src_, i));
+      if (map_file_quiet(filename, &b->files[i]) != 0) {
+        error("zstd_decompress(): Couldn't read file '%s'", filename);
+      }
+      b->nfiles++;
+      b->src[i]      = b->files[i].data;
+      b->src_size[i] = b->files[i].size;
+    } else {
+      SEXP elem_ = VECTOR_ELT(b->src_, i);
+      if (isNull(elem_)) {
+        b->dst_capacity[i] = NULL_ELEMENT;
+        continue;
+      }
+      b->src[i]      = RAW(elem_);
+      b->src_size[i] = (size_t)xlength(elem_);
+    }
+    
+    unsigned long long size = ZSTD_findDecompressedSize(b->src[i], b->src_size[i]);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+      error("zstd_decompress(): Element %.0f does not contain frames with known content size", (double)(i + 1));
+    }
+    b->dst_capacity[i] = (size_t)size;
+    total_size += (size_t)size;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Allocate output.
+  // Raw vectors are decompressed directly into the result list.
+  // Strings are decompressed into a single scratch buffer, and converted
+  // to CHARSXPs on the main thread afterwards.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  b->dst_ = PROTECT(allocVector(b->return_raw ? VECSXP : STRSXP, n));
+
+  unsigned char *scratch = NULL;
+  if (!b->return_raw) {
+    scratch = (unsigned char *)R_alloc(total_size > 0 ? total_size : 1, 1); // Freed by R, even on error
+  }
+  
+  size_t offset = 0;
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (b->dst_capacity[i] == NULL_ELEMENT) {
+      if (!b->return_raw) SET_STRING_ELT(b->dst_, i, NA_STRING);
+      continue;
+    }
+    if (b->return_raw) {
+      SEXP frame_ = allocVector(RAWSXP, (R_xlen_t)b->dst_capacity[i]);
+      SET_VECTOR_ELT(b->dst_, i, frame_);
+      b->dst[i] = RAW(frame_);
+    } else {
+      b->dst[i] = scratch + offset;
+      offset += b->dst_capacity[i];
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompress all elements
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  run_batch((size_t)n, b->num_threads, decompress_batch_item, b);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Check for errors, and create strings if requested.
+  // As with 'zstd_decompress(type = 'string')', a string is truncated at
+  // an embedded nul.  The caller warns after the cleanup has run.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (b->dst[i] == NULL) continue;
+    
+    size_t status = b->result[i];
+    if (ZSTD_isError(status)) {
+      error("zstd_decompress(): De-compression error on element %.0f. %s", (double)(i + 1),
+            ZSTD_getErrorName(status));
+    }
+    
+    if (!b->return_raw) {
+      int truncated = 0;
+      SET_STRING_ELT(b->dst_, i, mkchar_nul_truncated((char *)b->dst[i], b->dst_capacity[i], 
+                                                       "zstd_decompress()", &truncated));
+      if (truncated && b->nul_elem == 0) b->nul_elem = i + 1;
+    }
+  }
+
+  UNPROTECT(1);
+  return b->dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a list of compressed raw vectors, or a character vector of
+// filenames.  Every frame in each element is decompressed, and 
+// concatenated frames are returned as one contiguous output.
+//
+// type = 'raw'     return a list of raw vectors. NULL elements are kept as NULL
+// type = 'string'  return a character vector.  NULL elements become NA
+//
+// The decompressed size of each element is found on the main thread by
+// walking the frame headers, and all output memory is allocated before 
+// decompression starts.  If no user context is given and 'num_threads > 1'
+// the elements are decompressed concurrently, each thread with its own
+// context.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_decompress_list_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_) {
+
+  R_xlen_t n = xlength(src_);
+  int is_file = TYPEOF(src_) == STRSXP;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Check all elements before creating anything
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (is_file) {
+      if (STRING_ELT(src_, i) == NA_STRING) {
+        error("zstd_decompress(): Filename %.0f is NA", (double)(i + 1));
+      }
+    } else {
+      SEXP elem_ = VECTOR_ELT(src_, i);
+      if (!isNull(elem_) && TYPEOF(elem_) != RAWSXP) {
+        error("zstd_decompress(): List element %.0f is not a raw vector", (double)(i + 1));
+      }
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Allocate batch arrays.  Freed by R, even on error
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t nalloc = n > 0 ? (size_t)n : 1;
+  int num_threads = isNull(dctx_) ? batch_num_threads(opts_, (size_t)n) : 1;
+  decompress_batch_t b = {
+    .src_         = src_,
+    .dst_         = R_NilValue,
+    .dctx_        = dctx_,
+    .opts_        = opts_,
+    .n            = n,
+    .return_raw   = strcmp(CHAR(STRING_ELT(type_, 0)), "raw") == 0,
+    .num_threads  = num_threads,
+    .nul_elem     = 0,
+    .dctxs        = (ZSTD_DCtx **)R_alloc((size_t)num_threads, sizeof(ZSTD_DCtx *)),
+    .files        = is_file ? (mapped_file_t *)R_alloc(nalloc, sizeof(mapped_file_t)) : NULL,
+    .nfiles       = 0,
+    .src          = (unsigned char **)R_alloc(nalloc, sizeof(unsigned char *)),
+    .src_size     = (size_t *)R_alloc(nalloc, sizeof(size_t)),
+    .dst          = (unsigned char **)R_alloc(nalloc, sizeof(unsigned char *)),
+    .dst_capacity = (size_t *)R_alloc(nalloc, sizeof(size_t)),
+    .result       = (size_t *)R_alloc(nalloc, sizeof(size_t)),
+    .use_registry = 0
+  };
+  memset(b.dctxs, 0, (size_t)num_threads * sizeof(ZSTD_DCtx *));
+  memset(b.dst  , 0, nalloc * sizeof(unsigned char *));
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompress, then release all mappings and contexts
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP dst_ = PROTECT(R_ExecWithCleanup(decompress_batch, &b, decompress_batch_cleanup, &b));
+  
+  if (b.nul_elem > 0) {
+    warning("zstd_decompress(): element %.0f appears to contain an embedded nul and was truncated",
+            (double)b.nul_elem);
+  }
+  
+  UNPROTECT(1);
+  return dst_;
+}
@@ -0,0 +1,3 @@
+
+SEXP zstd_compress_list_(SEXP src_, SEXP cctx_, SEXP opts_);
+SEXP zstd_decompress_list_(SEXP src_, SEXP type_, SEXP dctx_, SEXP opts_);
@@ -0,0 +1,233 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zstd.h"
+#include "dctx.h"
+#include "dict-objects.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read lines of text from a compressed file.
+//
+// 'readLines(zstdfile())' goes through the connection's 'fgetc()' callback
+// one byte at a time.  Here the file is decompressed in large blocks and
+// each block is split on '\n' with 'memchr()', creating each CHARSXP
+// directly from the decompressed bytes.
+//
+// The decompression buffer holds the (incomplete) last line of the
+// previous block, followed by newly decompressed data.  It is doubled in
+// size when a single line takes up more than half of it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#define READ_LINES_BUF_SIZE  (1024 * 1024)
+#define READ_LINES_INIT_CAP  1024
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Lines collected so far.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP vec_;
+  PROTECT_INDEX ipx;
+  R_xlen_t n;        // number of lines in 'vec_'
+  R_xlen_t max;      // stop after this many lines. -1 = no limit
+  R_xlen_t skip;     // number of lines still to be skipped
+  R_xlen_t line_no;  // number of lines seen, including skipped lines
+  R_xlen_t nul_line; // first line containing a nul. 0 = none
+} lines_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Add a line, or skip it.  A trailing '\r' (from '\r\n') is removed.
+//
+// As with 'readLines()', a line is truncated at an embedded nul, as a
+// CHARSXP can't hold one ('mkCharLenCE()' would raise an error while the
+// file is still open).  The caller warns once the file is closed.
+//
+// @return TRUE if no more lines are wanted
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int lines_add(lines_t *lines, const char *str, size_t len) {
+  lines->line_no++;
+  if (lines->skip > 0) {
+    lines->skip--;
+    return FALSE;
+  }
+
+  if (lines->n == XLENGTH(lines->vec_)) {
+    R_xlen_t capacity = 2 * XLENGTH(lines->vec_);
+    if (lines->max >= 0 && capacity > lines->max) capacity = lines->max;
+    REPROTECT(lines->vec_ = xlengthgets(lines->vec_, capacity), lines->ipx);
+  }
+
+  if (len > 0 && str[len - 1] == '\r') len--;
+  const char *nul = memchr(str, '\0', len);
+  if (nul != NULL) {
+    len = (size_t)(nul - str);
+    if (lines->nul_line == 0) lines->nul_line = lines->line_no;
+  }
+  SET_STRING_ELT(lines->vec_, lines->n, mkCharLenCE(str, (int)len, CE_NATIVE));
+  lines->n++;
+
+  return lines->max >= 0 && lines->n >= lines->max;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read lines from a zstd compressed file
+//
+// @param src_ filename
+// @param n_ maximum number of lines to read. Negative = all lines
+// @param skip_ number of lines to skip before reading
+// @param dctx_ decompression context. Or NULL
+// @param opts_ named list of options for a new decompression context
+//
+// @return character vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_read_lines_(SEXP src_, SEXP n_, SEXP skip_, SEXP dctx_, SEXP opts_) {
+
+  if (TYPEOF(src_) != STRSXP) {
+    error("zstd_read_lines_() only accepts a filename");
+  }
+  const char *filename = CHAR(STRING_ELT(src_, 0));
+
+  double n    = asReal(n_);
+  double skip = asReal(skip_);
+  if (ISNAN(n)) {
+    error("zstd_read_lines(): 'n' must be a number");
+  }
+  if (!R_FINITE(skip) || skip < 0) {
+    error("zstd_read_lines(): 'skip' must be a non-negative number");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Result
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  lines_t lines = {
+    .n        = 0,
+    .max      = (n < 0 || !R_FINITE(n)) ? -1 : (R_xlen_t)n,
+    .skip     = (R_xlen_t)skip,
+    .line_no  = 0,
+    .nul_line = 0
+  };
+  R_xlen_t init_cap = READ_LINES_INIT_CAP;
+  if (lines.max >= 0 && lines.max < init_cap) init_cap = lines.max;
+  PROTECT_WITH_INDEX(lines.vec_ = allocVector(STRSXP, init_cap), &lines.ipx);
+
+  if (lines.max == 0) {
+    UNPROTECT(1);
+    return lines.vec_;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Buffers are freed by R at the end of the .Call() (even on error)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t in_size = ZSTD_DStreamInSize();
+  unsigned char *in = (unsigned char *)R_alloc(in_size, 1);
+
+  size_t buf_size = READ_LINES_BUF_SIZE;
+  char *buf = R_alloc(buf_size, 1);
+  size_t buf_len = 0; // bytes in 'buf'.  Always the start of a line
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The context is created first, as bad options raise an R error.
+  // While 'fp' is open, only a failed allocation can raise an R error.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  ZSTD_DCtx *dctx;
+  if (isNull(dctx_)) {
+    dctx = init_dctx_with_opts(opts_, 0, 0);
+  } else {
+    dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
+  }
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+    error("zstd_read_lines(): Couldn't open file '%s'", filename);
+  }
+
+  ZSTD_inBuffer input = { .src = in, .size = 0, .pos = 0 };
+  input.size = fread(in, 1, in_size, fp);
+  if (input.size > 0 && use_dict_registry(dctx_, opts_)) {
+    dctx_select_registered_dict(dctx, in, input.size);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompress into the free space after the incomplete last line,
+  // then split off all complete lines.
+  // A truncated last frame is not an error, so a file which is still
+  // being written (and flushed) can be read.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int done     = FALSE;
+  int out_full = FALSE; // zstd may hold more output even when input is used up
+  while (!done) {
+    if (input.pos == input.size && !out_full) {
+      input.size = fread(in, 1, in_size, fp);
+      input.pos  = 0;
+      if (input.size == 0) break;
+    }
+
+    if (buf_len > buf_size / 2) {
+      // A long line is taking up most of the buffer
+      char *tmp = R_alloc(2 * buf_size, 1);
+      memcpy(tmp, buf, buf_len);
+      buf       = tmp;
+      buf_size *= 2;
+    }
+
+    ZSTD_outBuffer output = { .dst = buf + buf_len, .size = buf_size - buf_len, .pos = 0 };
+    size_t res = ZSTD_decompressStream(dctx, &output, &input);
+    if (ZSTD_isError(res)) {
+      fclose(fp);
+      if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+      error("zstd_read_lines(): %s", ZSTD_getErrorName(res));
+    }
+    out_full = output.pos == output.size;
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Only the new data needs to be scanned for '\n'
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    char *start = buf;
+    char *p     = buf + buf_len;
+    char *end   = buf + buf_len + output.pos;
+    char *nl;
+    while (!done && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+      done  = lines_add(&lines, start, (size_t)(nl - start));
+      start = nl + 1;
+      p     = start;
+    }
+
+    buf_len = (size_t)(end - start);
+    if (start != buf && buf_len > 0) {
+      memmove(buf, start, buf_len);
+    }
+  }
+
+  fclose(fp);
+  if (isNull(dctx_)) ZSTD_freeDCtx(dctx);
+
+  // Final line without a trailing '\n'
+  if (!done && buf_len > 0) {
+    lines_add(&lines, buf, buf_len);
+  }
+
+  if (lines.n != XLENGTH(lines.vec_)) {
+    REPROTECT(lines.vec_ = xlengthgets(lines.vec_, lines.n), lines.ipx);
+  }
+
+  if (lines.nul_line > 0) {
+    warning("zstd_read_lines(): line %.0f appears to contain an embedded nul and was truncated",
+            (double)lines.nul_line);
+  }
+
+  UNPROTECT(1);
+  return lines.vec_;
+}
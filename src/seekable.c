@@ -0,0 +1,798 @@
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Connections.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "zstd/zstd.h"
+#include "utils.h"
+#include "seekable.h"
+
+// Reported when the write callback writes fewer bytes than it was given 
+// e.g. the disk is full.  This is 'ZSTD_error_dstSize_tooSmall' (error codes
+// are stable, but 'zstd_errors.h' is not part of the single file library)
+#define SEEKABLE_ERROR_WRITE ((size_t)-70)
+
+// Reported when the seek table can't be allocated.  'ZSTD_error_memory_allocation'
+#define SEEKABLE_ERROR_MEMORY ((size_t)-64)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains code for writing and reading the zstd seekable format.
+//
+// The data is compressed as a sequence of independent frames, each holding 
+// at most 'frame_size' bytes of uncompressed data.  After the last frame
+// a skippable frame is written which contains the seek table, i.e. the 
+// compressed and decompressed size of every frame.
+//
+//   Skippable_Magic_Number   4 bytes  0x184D2A5E
+//   Frame_Size               4 bytes  size of the rest of the skippable frame
+//   Seek_Table_Entries       8 bytes per frame (no checksums)
+//     Compressed_Size          4 bytes
+//     Decompressed_Size        4 bytes
+//   Seek_Table_Footer        9 bytes
+//     Number_Of_Frames         4 bytes
+//     Seek_Table_Descriptor    1 byte   (0 = no checksums)
+//     Seekable_Magic_Number    4 bytes  0x8F92EAB1
+//
+// All integers are little-endian.
+//
+// Because it is a skippable frame, the seek table is ignored by any 
+// zstd decompressor (including the 'zstd' command line), so the file 
+// is still a valid zstd file.  
+//
+// A reader which understands the seek table can jump directly to the 
+// frame containing any uncompressed offset.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write callbacks for files and R connections
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_write_file(const void *buf, size_t len, void *data) {
+  return fwrite(buf, 1, len, (FILE *)data);
+}
+
+size_t seekable_write_conn(const void *buf, size_t len, void *data) {
+  return R_WriteConnection((Rconnection)data, (void *)buf, len);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write callback for an in-memory buffer.  
+// The buffer should be sized with 'seekable_compress_bound()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_write_mem(const void *buf, size_t len, void *data) {
+  seekable_mem_t *mem = (seekable_mem_t *)data;
+  if (len > mem->capacity - mem->pos) {
+    len = mem->capacity - mem->pos;
+  }
+  memcpy(mem->dst + mem->pos, buf, len);
+  mem->pos += len;
+  return len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Maximum compressed size in the worst case when writing 'src_size' bytes 
+// in frames of 'frame_size', including the seek table
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_compress_bound(size_t src_size, size_t frame_size) {
+  if (frame_size == 0) {
+    return ZSTD_compressBound(src_size);
+  }
+  
+  size_t nframes = src_size / frame_size;
+  size_t last    = src_size % frame_size;
+  
+  size_t bound = nframes * ZSTD_compressBound(frame_size);
+  if (last > 0 || nframes == 0) {
+    bound += ZSTD_compressBound(last);
+    nframes++;
+  }
+  
+  return bound + 8 + nframes * sizeof(seek_entry_t) + SEEKABLE_FOOTER_SIZE;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find the 'frame_size' option in the list of user options.
+// Other options are handled by 'init_cctx_with_opts()'
+//
+// @return frame size, or 0 if not set
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_frame_size_opt(SEXP opts_) {
+  if (length(opts_) == 0) return 0;
+  
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (isNull(nms_)) return 0;
+  
+  for (int i = 0; i < length(opts_); i++) {
+    if (strcmp(CHAR(STRING_ELT(nms_, i)), "frame_size") == 0) {
+      double frame_size = asReal(VECTOR_ELT(opts_, i));
+      if (ISNA(frame_size) || frame_size < 0) {
+        error("'frame_size' must be a non-negative number");
+      }
+      if (frame_size > SEEKABLE_MAX_FRAME_SIZE) {
+        error("'frame_size' must be at most %i bytes", SEEKABLE_MAX_FRAME_SIZE);
+      }
+      return (size_t)frame_size;
+    }
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append an entry to the seek table.
+//
+// Does not call the R API, as frames may be ended by the async writer thread.
+// @return 0 or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t seek_table_add(seek_table_t *table, size_t c_size, size_t d_size) {
+  if (table->n == table->capacity) {
+    size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    seek_entry_t *entries = realloc(table->entries, capacity * sizeof(seek_entry_t));
+    if (entries == NULL) {
+      return SEEKABLE_ERROR_MEMORY;
+    }
+    table->entries  = entries;
+    table->capacity = capacity;
+  }
+  
+  table->entries[table->n].c_size = (uint32_t)c_size;
+  table->entries[table->n].d_size = (uint32_t)d_size;
+  table->n++;
+  return 0;
+}
+
+
+static void write_le32(unsigned char *dst, uint32_t x) {
+  dst[0] = (unsigned char)(x      );
+  dst[1] = (unsigned char)(x >>  8);
+  dst[2] = (unsigned char)(x >> 16);
+  dst[3] = (unsigned char)(x >> 24);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise a writer.
+//
+// @param frame_size maximum uncompressed bytes per frame. 0 means a single 
+//        frame with no seek table
+// @param total_size total number of bytes which will be written, or
+//        ZSTD_CONTENTSIZE_UNKNOWN.  If known, the size of each frame is 
+//        pledged so it is recorded in the frame header
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seekable_writer_init(seekable_writer_t *w, ZSTD_CCtx *cctx, size_t frame_size, 
+                          unsigned long long total_size, seekable_write_fn write, void *write_data) {
+  memset(w, 0, sizeof(seekable_writer_t));
+  
+  w->cctx       = cctx;
+  w->frame_size = frame_size;
+  w->remaining  = total_size;
+  w->write      = write;
+  w->write_data = write_data;
+  
+  w->out_size = ZSTD_CStreamOutSize();
+  w->out      = malloc(w->out_size);
+  if (w->out == NULL) {
+    error("seekable_writer_init(): Couldn't allocate output buffer");
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Continue writing at the end of an existing file opened with "r+b".
+//
+// If the writer is writing a seek table and the file ends with a valid one,
+// the table's entries are carried over and the old table is truncated 
+// from the file.  New frames and the new table are then written in its 
+// place, so the file keeps a single seek table covering all frames.  Only 
+// the old table is read.  
+//
+// If the append is interrupted (or the file is read after a 'flush()'), 
+// the file is still valid zstd data, just without a seek table.
+//
+// Otherwise new frames are written after all existing data.
+//
+// @return 0 on success, -1 if the file couldn't be positioned or truncated,
+//         or the seek table couldn't be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int seekable_writer_resume(seekable_writer_t *w, FILE *fp) {
+  long long end = -1;
+  
+  if (w->frame_size > 0) {
+    seek_index_t index;
+    seek_index_init(&index);
+    if (seek_index_read_table(&index, fp)) {
+      for (size_t i = 1; i < index.n; i++) {
+        size_t res = seek_table_add(
+          &w->table, 
+          index.points[i].c_offset - index.points[i - 1].c_offset,
+          index.points[i].d_offset - index.points[i - 1].d_offset
+        );
+        if (ZSTD_isError(res)) {
+          seek_index_free(&index);
+          return -1;
+        }
+      }
+      end = seek_file(fp, (long long)index.points[index.n - 1].c_offset, SEEK_SET);
+      seek_index_free(&index);
+      // The old table's entries are already carried over
+      if (end < 0 || truncate_file(fp, end) < 0) return -1;
+      return 0;
+    }
+    seek_index_free(&index);
+  }
+  
+  if (end < 0) {
+    end = seek_file(fp, 0, SEEK_END);
+  }
+  
+  return end < 0 ? -1 : 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Free memory held by the writer.  Does not free the 'cctx'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seekable_writer_free(seekable_writer_t *w) {
+  free(w->out);
+  free(w->table.entries);
+  w->out           = NULL;
+  w->table.entries = NULL;
+  w->table.n       = 0;
+  w->table.capacity = 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start a new frame.  
+// If the total size is known, pledge the size of this frame.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t start_frame(seekable_writer_t *w) {
+  if (w->remaining != ZSTD_CONTENTSIZE_UNKNOWN) {
+    unsigned long long pledge = w->remaining;
+    if (w->frame_size > 0 && pledge > w->frame_size) {
+      pledge = w->frame_size;
+    }
+    size_t res = ZSTD_CCtx_setPledgedSrcSize(w->cctx, pledge);
+    if (ZSTD_isError(res)) return res;
+    w->remaining -= pledge;
+  }
+  
+  w->in_frame = 1;
+  w->frame_c  = 0;
+  w->frame_d  = 0;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress input with the given directive and write all output
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t compress_and_write(seekable_writer_t *w, ZSTD_inBuffer *input, ZSTD_EndDirective mode) {
+  size_t remaining;
+  do {
+    ZSTD_outBuffer output = {
+      .dst  = w->out,
+      .size = w->out_size,
+      .pos  = 0
+    };
+    remaining = ZSTD_compressStream2(w->cctx, &output, input, mode);
+    if (ZSTD_isError(remaining)) return remaining;
+    
+    if (output.pos > 0) {
+      size_t written = w->write(output.dst, output.pos, w->write_data);
+      if (written != output.pos) return SEEKABLE_ERROR_WRITE;
+      w->frame_c += output.pos;
+    }
+  } while (input->pos != input->size || (mode != ZSTD_e_continue && remaining > 0));
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish the current frame and record it in the seek table
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t end_frame(seekable_writer_t *w) {
+  ZSTD_inBuffer input = { .src = NULL, .size = 0, .pos = 0 };
+  size_t res = compress_and_write(w, &input, ZSTD_e_end);
+  if (ZSTD_isError(res)) return res;
+  
+  if (w->frame_size > 0) {
+    res = seek_table_add(&w->table, w->frame_c, w->frame_d);
+    if (ZSTD_isError(res)) return res;
+  }
+  w->in_frame = 0;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress 'len' bytes.  A new frame is started whenever the current 
+// frame reaches 'frame_size' uncompressed bytes.
+//
+// @return 0 or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_writer_compress(seekable_writer_t *w, const void *src, size_t len) {
+  size_t pos = 0;
+  
+  while (pos < len) {
+    size_t res;
+    if (!w->in_frame) {
+      res = start_frame(w);
+      if (ZSTD_isError(res)) return res;
+    }
+    
+    size_t chunk = len - pos;
+    if (w->frame_size > 0 && chunk > w->frame_size - w->frame_d) {
+      chunk = w->frame_size - w->frame_d;
+    }
+    
+    ZSTD_inBuffer input = {
+      .src  = (const unsigned char *)src + pos,
+      .size = chunk,
+      .pos  = 0
+    };
+    res = compress_and_write(w, &input, ZSTD_e_continue);
+    if (ZSTD_isError(res)) return res;
+    
+    w->frame_d += chunk;
+    pos        += chunk;
+    
+    if (w->frame_size > 0 && w->frame_d == w->frame_size) {
+      res = end_frame(w);
+      if (ZSTD_isError(res)) return res;
+    }
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write out all data compressed so far, ending the current block but not 
+// the frame.  The output can then be decompressed up to this point, while
+// later data can still reference earlier data in the frame.
+//
+// @return 0 or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_writer_flush(seekable_writer_t *w) {
+  if (!w->in_frame) return 0;
+  
+  ZSTD_inBuffer input = { .src = NULL, .size = 0, .pos = 0 };
+  return compress_and_write(w, &input, ZSTD_e_flush);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish the last frame, and write the seek table.
+// Always writes at least one frame, so empty input is still a valid 
+// zstd file.
+//
+// @return 0 or a zstd error code
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t seekable_writer_end(seekable_writer_t *w) {
+  size_t res;
+  
+  if (!w->in_frame && (w->frame_size == 0 || w->table.n == 0)) {
+    res = start_frame(w);
+    if (ZSTD_isError(res)) return res;
+  }
+  if (w->in_frame) {
+    res = end_frame(w);
+    if (ZSTD_isError(res)) return res;
+  }
+  
+  if (w->frame_size == 0) return 0;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Seek table as a skippable frame
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t table_size = 8 + w->table.n * sizeof(seek_entry_t) + SEEKABLE_FOOTER_SIZE;
+  unsigned char *buf = malloc(table_size);
+  if (buf == NULL) {
+    return SEEKABLE_ERROR_MEMORY;
+  }
+  
+  unsigned char *p = buf;
+  write_le32(p, SEEKABLE_SKIPPABLE_MAGIC);  p += 4;
+  write_le32(p, (uint32_t)(table_size - 8)); p += 4;
+  for (size_t i = 0; i < w->table.n; i++) {
+    write_le32(p, w->table.entries[i].c_size); p += 4;
+    write_le32(p, w->table.entries[i].d_size); p += 4;
+  }
+  write_le32(p, (uint32_t)w->table.n); p += 4;
+  *p++ = 0; // Seek_Table_Descriptor: no checksums
+  write_le32(p, SEEKABLE_MAGIC);
+  
+  size_t written = w->write(buf, table_size, w->write_data);
+  free(buf);
+  
+  return written == table_size ? 0 : SEEKABLE_ERROR_WRITE;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Reading.
+//
+// A seek index holds the start of every known frame.  It is either read
+// in full from the seek table of a seekable file, or populated lazily by
+// the reader recording each frame boundary as it is decompressed.  
+//
+// Zstd can only restart decompression at the start of a frame, so a 
+// single-frame file only ever has a checkpoint at offset 0.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise an index with a single point at the start of the file
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seek_index_init(seek_index_t *index) {
+  memset(index, 0, sizeof(seek_index_t));
+  seek_index_add(index, 0, 0);
+}
+
+
+void seek_index_free(seek_index_t *index) {
+  free(index->points);
+  memset(index, 0, sizeof(seek_index_t));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append a point to the index.
+//
+// Points must be added in file order.  Frames are only discovered by 
+// decompressing forward from a known point, so a point at or before the 
+// last known point has already been recorded and is ignored.
+//
+// Does not call the R API, so may be used off the R thread.
+// @return 0 on success. -1 if memory could not be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int seek_index_add_quiet(seek_index_t *index, uint64_t c_offset, uint64_t d_offset) {
+  if (index->complete) return 0;
+  if (index->n > 0 && c_offset <= index->points[index->n - 1].c_offset) return 0;
+  
+  if (index->n == index->capacity) {
+    size_t capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+    seek_point_t *points = realloc(index->points, capacity * sizeof(seek_point_t));
+    if (points == NULL) {
+      return -1;
+    }
+    index->points   = points;
+    index->capacity = capacity;
+  }
+  
+  index->points[index->n].c_offset = c_offset;
+  index->points[index->n].d_offset = d_offset;
+  index->n++;
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// As above, but raises an R error if memory can't be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seek_index_add(seek_index_t *index, uint64_t c_offset, uint64_t d_offset) {
+  if (seek_index_add_quiet(index, c_offset, d_offset) != 0) {
+    error("seek_index_add(): Couldn't allocate seek index");
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find the last point at or before the given uncompressed offset
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+seek_point_t *seek_index_find(seek_index_t *index, uint64_t d_offset) {
+  size_t lo = 0;
+  size_t hi = index->n;
+  
+  // Binary search for the first point with 'd_offset' beyond the target
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->points[mid].d_offset <= d_offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  
+  return &index->points[lo > 0 ? lo - 1 : 0];
+}
+
+
+static uint32_t read_le32(const unsigned char *src) {
+  return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | 
+    ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the seek table (including its skippable frame header) given 
+// the footer at the very end of the data.
+//
+// Footer: Number_Of_Frames, Seek_Table_Descriptor, Seekable_Magic_Number
+// Descriptor bit 7 indicates per-frame checksums. Bits 2-6 are reserved.
+//
+// @return size of seek table, or 0 if the footer is not valid
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint64_t seek_table_size(const unsigned char *footer) {
+  uint32_t nframes   = read_le32(footer);
+  unsigned char desc = footer[4];
+  if (read_le32(footer + 5) != SEEKABLE_MAGIC || (desc & 0x7C) != 0) return 0;
+  
+  uint64_t entry_size = (desc & 0x80) ? 12 : 8;
+  return 8 + nframes * entry_size + SEEKABLE_FOOTER_SIZE;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Parse a seek table into the index.
+//
+// The table is only used if the frame sizes it lists account for all 
+// the data, otherwise the index is left with its single point at the start.
+//
+// @param table the complete seek table.  Its size is given by the footer
+// @param total_size size of all the compressed data (including the table)
+//
+// @return 1 if the seek table is valid, otherwise 0
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int parse_seek_table(seek_index_t *index, const unsigned char *table, 
+                            uint64_t table_size, uint64_t total_size) {
+  
+  if (read_le32(table) != SEEKABLE_SKIPPABLE_MAGIC ||
+      read_le32(table + 4) != (uint32_t)(table_size - 8)) return 0;
+  
+  uint32_t nframes    = read_le32(table + table_size - SEEKABLE_FOOTER_SIZE);
+  uint64_t entry_size = (table[table_size - 5] & 0x80) ? 12 : 8;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Cumulative offsets.  The last point is the end of the data.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint64_t c_offset = 0;
+  uint64_t d_offset = 0;
+  const unsigned char *p = table + 8;
+  for (uint32_t i = 0; i < nframes; i++) {
+    c_offset += read_le32(p);
+    d_offset += read_le32(p + 4);
+    seek_index_add(index, c_offset, d_offset);
+    p += entry_size;
+  }
+  
+  if (c_offset + table_size != total_size) {
+    index->n = 1;
+    return 0;
+  }
+  
+  index->complete = 1;
+  return 1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read the seek table from the end of a file into the index.
+// Only the table itself is read.  The file position is reset to the start.
+//
+// @return 1 if a seek table was read, otherwise 0
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int seek_index_read_table(seek_index_t *index, FILE *fp) {
+  int found = 0;
+  unsigned char *buf = NULL;
+  unsigned char footer[SEEKABLE_FOOTER_SIZE];
+  
+  long long fsize = seek_file(fp, 0, SEEK_END);
+  if (fsize < 8 + SEEKABLE_FOOTER_SIZE) goto done;
+  
+  if (seek_file(fp, fsize - SEEKABLE_FOOTER_SIZE, SEEK_SET) < 0) goto done;
+  if (fread(footer, 1, SEEKABLE_FOOTER_SIZE, fp) != SEEKABLE_FOOTER_SIZE) goto done;
+  
+  uint64_t table_size = seek_table_size(footer);
+  if (table_size == 0 || table_size > (uint64_t)fsize) goto done;
+  
+  buf = malloc((size_t)table_size);
+  if (buf == NULL) goto done;
+  if (seek_file(fp, fsize - (long long)table_size, SEEK_SET) < 0) goto done;
+  if (fread(buf, 1, (size_t)table_size, fp) != (size_t)table_size) goto done;
+  
+  found = parse_seek_table(index, buf, table_size, (uint64_t)fsize);
+  
+done:
+  free(buf);
+  rewind(fp);
+  return found;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read the seek table from the end of compressed data in memory
+//
+// @return 1 if a seek table was read, otherwise 0
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int seek_index_read_table_mem(seek_index_t *index, const unsigned char *src, size_t src_size) {
+  if (src_size < 8 + SEEKABLE_FOOTER_SIZE) return 0;
+  
+  uint64_t table_size = seek_table_size(src + src_size - SEEKABLE_FOOTER_SIZE);
+  if (table_size == 0 || table_size > src_size) return 0;
+  
+  return parse_seek_table(index, src + src_size - table_size, table_size, src_size);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Number of bytes a single frame decompresses to, when it is not 
+// recorded in the frame header.  The output is discarded.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t frame_decompressed_size(ZSTD_DCtx *dctx, unsigned char *buf, size_t buf_size, 
+                                      const unsigned char *src, size_t src_size, 
+                                      unsigned long long *d_size) {
+  ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+  ZSTD_inBuffer input = { .src = src, .size = src_size, .pos = 0 };
+  *d_size = 0;
+  
+  size_t res;
+  do {
+    ZSTD_outBuffer output = { .dst = buf, .size = buf_size, .pos = 0 };
+    res = ZSTD_decompressStream(dctx, &output, &input);
+    if (ZSTD_isError(res)) return res;
+    *d_size += output.pos;
+  } while (res != 0 && input.pos < input.size);
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Build a complete index by walking the frames of compressed data.
+//
+// Frame boundaries are found from the block headers, so only frames which
+// do not record their content size need to be decompressed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seek_index_scan(seek_index_t *index, const unsigned char *src, size_t src_size) {
+  
+  ZSTD_DCtx *dctx = NULL;
+  unsigned char *buf = NULL;
+  size_t buf_size = ZSTD_DStreamOutSize();
+  
+  size_t   c_offset = 0;
+  uint64_t d_offset = 0;
+  
+  while (c_offset < src_size) {
+    const unsigned char *frame = src + c_offset;
+    size_t c_size = ZSTD_findFrameCompressedSize(frame, src_size - c_offset);
+    if (ZSTD_isError(c_size)) {
+      ZSTD_freeDCtx(dctx);
+      free(buf);
+      error("seek_index_scan(): Invalid frame at offset %zu: %s", c_offset, ZSTD_getErrorName(c_size));
+    }
+    
+    // Skippable frames have a content size of 0
+    unsigned long long d_size = ZSTD_getFrameContentSize(frame, c_size);
+    if (d_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      if (dctx == NULL) {
+        dctx = ZSTD_createDCtx();
+        buf  = malloc(buf_size);
+        if (dctx == NULL || buf == NULL) {
+          ZSTD_freeDCtx(dctx);
+          free(buf);
+          error("seek_index_scan(): Couldn't allocate decompression context");
+        }
+      }
+      size_t res = frame_decompressed_size(dctx, buf, buf_size, frame, c_size, &d_size);
+      if (ZSTD_isError(res)) {
+        ZSTD_freeDCtx(dctx);
+        free(buf);
+        error("seek_index_scan(): Frame at offset %zu: %s", c_offset, ZSTD_getErrorName(res));
+      }
+    } else if (d_size == ZSTD_CONTENTSIZE_ERROR) {
+      ZSTD_freeDCtx(dctx);
+      free(buf);
+      error("seek_index_scan(): Invalid frame header at offset %zu", c_offset);
+    }
+    
+    c_offset += c_size;
+    d_offset += d_size;
+    seek_index_add(index, c_offset, d_offset);
+  }
+  
+  ZSTD_freeDCtx(dctx);
+  free(buf);
+  index->complete = 1;
+}
+
+
+static void write_le64(unsigned char *dst, uint64_t x) {
+  write_le32(dst    , (uint32_t)(x      ));
+  write_le32(dst + 4, (uint32_t)(x >> 32));
+}
+
+static uint64_t read_le64(const unsigned char *src) {
+  return (uint64_t)read_le32(src) | ((uint64_t)read_le32(src + 4) << 32);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sidecar index file.  
+// Used for files which cannot be rewritten with a seek table.
+//
+//   Magic                  4 bytes  "ZSTI"
+//   Number_Of_Points       8 bytes
+//   Points                16 bytes per point
+//     Compressed_Offset      8 bytes
+//     Decompressed_Offset    8 bytes
+//
+// All integers are little-endian.  The first point is the start of the 
+// data and the last point is the end, so the last compressed offset is 
+// the size of the compressed file.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seek_index_write_file(seek_index_t *index, const char *filename) {
+  size_t size = 12 + index->n * 16;
+  unsigned char *buf = malloc(size);
+  if (buf == NULL) {
+    error("seek_index_write_file(): Couldn't allocate %zu bytes", size);
+  }
+  
+  unsigned char *p = buf;
+  write_le32(p, SEEK_INDEX_MAGIC); p += 4;
+  write_le64(p, index->n);         p += 8;
+  for (size_t i = 0; i < index->n; i++) {
+    write_le64(p, index->points[i].c_offset); p += 8;
+    write_le64(p, index->points[i].d_offset); p += 8;
+  }
+  
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    free(buf);
+    error("seek_index_write_file(): Couldn't open '%s' for writing", filename);
+  }
+  size_t nwritten = fwrite(buf, 1, size, fp);
+  fclose(fp);
+  free(buf);
+  
+  if (nwritten != size) {
+    error("seek_index_write_file(): Only wrote %zu/%zu bytes to '%s'", nwritten, size, filename);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Replace the contents of the index with a sidecar index file
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void seek_index_read_file(seek_index_t *index, const char *filename) {
+  size_t size;
+  unsigned char *buf = read_file(filename, &size);
+  
+  if (size < 12 || read_le32(buf) != SEEK_INDEX_MAGIC) {
+    free(buf);
+    error("seek_index_read_file(): '%s' is not a zstd index file", filename);
+  }
+  
+  uint64_t n = read_le64(buf + 4);
+  if (n < 1 || n > (size - 12) / 16 || size != 12 + n * 16) {
+    free(buf);
+    error("seek_index_read_file(): '%s' is truncated or corrupt", filename);
+  }
+  
+  seek_index_free(index);
+  const unsigned char *p = buf + 12;
+  for (uint64_t i = 0; i < n; i++) {
+    seek_index_add(index, read_le64(p), read_le64(p + 8));
+    p += 16;
+  }
+  free(buf);
+  
+  if (index->n != n || index->points[0].c_offset != 0 || index->points[0].d_offset != 0) {
+    error("seek_index_read_file(): '%s' is corrupt", filename);
+  }
+  index->complete = 1;
+}
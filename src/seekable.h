@@ -0,0 +1,106 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Zstd seekable format.
+// See: https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+
+#define SEEKABLE_SKIPPABLE_MAGIC   0x184D2A5E
+#define SEEKABLE_MAGIC             0x8F92EAB1
+#define SEEKABLE_FOOTER_SIZE       9
+#define SEEKABLE_MAX_FRAME_SIZE    (1024 * 1024 * 1024)
+#define SEEK_INDEX_MAGIC           0x4954535A  // "ZSTI" sidecar index file
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Seek table. One entry per frame
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  uint32_t c_size; // compressed size of frame
+  uint32_t d_size; // decompressed size of frame
+} seek_entry_t;
+
+typedef struct {
+  seek_entry_t *entries;
+  size_t n;
+  size_t capacity;
+} seek_table_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write compressed data to a file, connection etc.
+// @return number of bytes written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef size_t (*seekable_write_fn)(const void *buf, size_t len, void *data);
+
+size_t seekable_write_file(const void *buf, size_t len, void *data);
+size_t seekable_write_conn(const void *buf, size_t len, void *data);
+
+typedef struct {
+  unsigned char *dst;
+  size_t capacity;
+  size_t pos;
+} seekable_mem_t;
+
+size_t seekable_write_mem(const void *buf, size_t len, void *data);
+size_t seekable_compress_bound(size_t src_size, size_t frame_size);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Streaming compression, optionally split into independent frames of at 
+// most 'frame_size' uncompressed bytes, followed by a seek table.
+// If 'frame_size = 0' all data is written as a single frame with no seek table.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  ZSTD_CCtx *cctx;
+  size_t frame_size;            // max uncompressed bytes per frame. 0 = no limit
+  unsigned long long remaining; // bytes still to be written, or ZSTD_CONTENTSIZE_UNKNOWN
+  int in_frame;                 // Boolean: has the current frame been started?
+  size_t frame_d;               // uncompressed bytes in current frame
+  size_t frame_c;               // compressed bytes in current frame
+  seek_table_t table;
+  seekable_write_fn write;
+  void *write_data;
+  unsigned char *out;           // output buffer of 'ZSTD_CStreamOutSize()'
+  size_t out_size;
+} seekable_writer_t;
+
+size_t seekable_frame_size_opt(SEXP opts_);
+
+void   seekable_writer_init(seekable_writer_t *w, ZSTD_CCtx *cctx, size_t frame_size, 
+                            unsigned long long total_size, seekable_write_fn write, void *write_data);
+int    seekable_writer_resume(seekable_writer_t *w, FILE *fp);
+size_t seekable_writer_compress(seekable_writer_t *w, const void *src, size_t len);
+size_t seekable_writer_flush(seekable_writer_t *w);
+size_t seekable_writer_end(seekable_writer_t *w);
+void   seekable_writer_free(seekable_writer_t *w);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Seek index for reading.  
+// Each point is the start of a frame: decompression can restart from 
+// 'c_offset' in the compressed file with a freshly reset context and will
+// produce uncompressed data starting at 'd_offset'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  uint64_t c_offset; // offset of frame in compressed file
+  uint64_t d_offset; // offset of frame in uncompressed data
+} seek_point_t;
+
+typedef struct {
+  seek_point_t *points;
+  size_t n;
+  size_t capacity;
+  int complete;     // Boolean: every frame is indexed and the last point is the end of the data
+} seek_index_t;
+
+void          seek_index_init(seek_index_t *index);
+void          seek_index_free(seek_index_t *index);
+void          seek_index_add(seek_index_t *index, uint64_t c_offset, uint64_t d_offset);
+int           seek_index_add_quiet(seek_index_t *index, uint64_t c_offset, uint64_t d_offset);
+seek_point_t *seek_index_find(seek_index_t *index, uint64_t d_offset);
+int           seek_index_read_table(seek_index_t *index, FILE *fp);
+int           seek_index_read_table_mem(seek_index_t *index, const unsigned char *src, size_t src_size);
+void          seek_index_scan(seek_index_t *index, const unsigned char *src, size_t src_size);
+void          seek_index_write_file(seek_index_t *index, const char *filename);
+void          seek_index_read_file(seek_index_t *index, const char *filename);
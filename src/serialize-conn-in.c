@@ -18,6 +18,7 @@
 #include "zstd.h"
 #include "calc-size-robust.h"
 #include "dctx.h"
+#include "dict-objects.h"
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -129,6 +130,7 @@ SEXP zstd_unserialize_conn_(SEXP conn_, SEXP dctx_, SEXP opts_) {
   ZSTD_DCtx *dctx;
   if (!isNull(dctx_)) {
     dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
   } else {
     dctx = init_dctx_with_opts(opts_, 0, 0); // Streaming does NOT have stable buffers
   }
@@ -143,6 +145,12 @@ SEXP zstd_unserialize_conn_(SEXP conn_, SEXP dctx_, SEXP opts_) {
     .compressed_len   = 0,
     .compressed_size  = INSIZE
   };
+  
+  // Read ahead to find the dictionary ID in the frame header
+  if (use_dict_registry(dctx_, opts_)) {
+    user_data.compressed_len = R_ReadConnection(user_data.rconn, user_data.compressed_data, user_data.compressed_size);
+    dctx_select_registered_dict(dctx, user_data.compressed_data, user_data.compressed_len);
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Setup the R serialization struct
@@ -141,7 +141,7 @@ SEXP zstd_serialize_conn_(SEXP robj, SEXP conn_, SEXP cctx_, SEXP opts_) {
   // Create the buffer for the serialized representation
   // Calculate the exact size of the serialized object in bytes
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int num_serialized_bytes = calc_serialized_size(robj);
+  size_t num_serialized_bytes = calc_serialized_size(robj);
   stream_conn_buffer_t buf = {
     .uncompressed_pos  = 0, 
     .uncompressed_size = INSIZE,
@@ -13,6 +13,7 @@
 #include "zstd.h"
 #include "calc-size-robust.h"
 #include "dctx.h"
+#include "dict-objects.h"
 #include "serialize-file.h"
 
 
@@ -124,6 +125,7 @@ SEXP zstd_unserialize_stream_file_(SEXP src_, SEXP dctx_, SEXP opts_) {
   ZSTD_DCtx *dctx;
   if (!isNull(dctx_)) {
     dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
   } else {
     dctx = init_dctx_with_opts(opts_, 0, 0); // Streaming does NOT have stable buffers
   }
@@ -147,6 +149,12 @@ SEXP zstd_unserialize_stream_file_(SEXP src_, SEXP dctx_, SEXP opts_) {
     .compressed_len   = 0,
     .compressed_size  = INSIZE
   };
+  
+  // Read ahead to find the dictionary ID in the frame header
+  if (use_dict_registry(dctx_, opts_)) {
+    user_data.compressed_len = fread(user_data.compressed_data, 1, user_data.compressed_size, fp);
+    dctx_select_registered_dict(dctx, user_data.compressed_data, user_data.compressed_len);
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Setup the R serialization struct
@@ -153,7 +153,7 @@ SEXP zstd_serialize_stream_file_(SEXP robj, SEXP file_, SEXP cctx_, SEXP opts_)
   // Create the buffer for the serialized representation
   // Calculate the exact size of the serialized object in bytes
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int num_serialized_bytes = calc_serialized_size(robj);
+  size_t num_serialized_bytes = calc_serialized_size(robj);
   stream_file_buffer_t buf = {
     .uncompressed_pos = 0, 
     .uncompressed_size = INSIZE,
@@ -13,6 +13,7 @@
 #include "zstd.h"
 #include "calc-size-robust.h"
 #include "dctx.h"
+#include "dict-objects.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // A data buffer of constant size
@@ -88,6 +89,7 @@ SEXP zstd_unserialize_stream_(SEXP src_, SEXP dctx_, SEXP opts_) {
     dctx = init_dctx_with_opts(opts_, 0, 0); // Streaming does NOT have stable buffers
   } else {
     dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(dctx);
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -104,10 +106,14 @@ SEXP zstd_unserialize_stream_(SEXP src_, SEXP dctx_, SEXP opts_) {
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (TYPEOF(src_) == RAWSXP) {
     user_data.compressed_data = (unsigned char *)RAW(src_);
-    user_data.compressed_size = (size_t)length(src_);
+    user_data.compressed_size = (size_t)xlength(src_);
   } else {
     error("zstd_unserialize_stream_(): source must be a raw vector");
   }
+  
+  if (use_dict_registry(dctx_, opts_)) {
+    dctx_select_registered_dict(dctx, user_data.compressed_data, user_data.compressed_size);
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Setup the R serialization struct
@@ -11,256 +11,164 @@
 #include <unistd.h>
 
 #include "zstd.h"
-#include "calc-size-robust.h"
+#include "buffer-growable.h"
 #include "cctx.h"
 
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// A data buffer of constant size
-// Needs total length and pos to keep track of how much data it currently contains
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
 #define INSIZE 131702  // Calculated via ZSTD_CStream_InSize()
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialized bytes are collected in a buffer of constant size, and 
+// compressed whenever it is full.  Only the compressed output grows, so 
+// the serialized object is never held in memory in full.
+//
+// The total size isn't known until serialization is finished, so the 
+// frame header has no content size.  
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 typedef struct {
+  SEXP robj_;
   ZSTD_CCtx *cctx;
-  ZSTD_outBuffer zstd_buffer;
-  unsigned char uncompressed_data[INSIZE]; 
+  int user_cctx;
+  growable_buffer_t out;
+  unsigned char *uncompressed_data;
   size_t uncompressed_pos;
-  size_t uncompressed_size;
 } serialize_stream_buffer_t;
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress all of 'input', growing the output as needed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void compress_to_stream(serialize_stream_buffer_t *buf, ZSTD_inBuffer *input, ZSTD_EndDirective mode) {
+  size_t remaining;
+  do {
+    if (buf->out.output.pos == buf->out.output.size) {
+      grow_growable_buffer(&buf->out);
+    }
+    remaining = ZSTD_compressStream2(buf->cctx, &buf->out.output, input, mode);
+    if (ZSTD_isError(remaining)) {
+      error("zstd_serialize_stream(): Compression error. %s", ZSTD_getErrorName(remaining));
+    }
+  } while (input->pos != input->size || (mode == ZSTD_e_end && remaining > 0));
+}
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Write a byte into the buffer at the current location.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_byte_to_stream(R_outpstream_t stream, int c) {
+static void write_byte_to_stream(R_outpstream_t stream, int c) {
   error("write_byte_to_stream(): Not implemented");
 }
 
 
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Write multiple bytes to file
+// Write multiple bytes.  When the buffer is full, it is compressed.
+// Writes larger than the buffer are compressed directly.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_bytes_to_stream(R_outpstream_t stream, void *src, int length) {
+static void write_bytes_to_stream(R_outpstream_t stream, void *src, int length) {
   serialize_stream_buffer_t *buf = (serialize_stream_buffer_t *)stream->data;
   
-  
-  if (buf->uncompressed_pos + (size_t)length >= buf->uncompressed_size) {
-    // There's not enough space to add these new bytes to the
-    // uncompressed_data buffer.  So first let's flush 
-    // the uncompressed data buffer by compressing and writing to file
-    
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    // COmperssion input = uncompressed data buffer
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (buf->uncompressed_pos + (size_t)length > INSIZE) {
     ZSTD_inBuffer input = { 
       .src  = buf->uncompressed_data, 
       .size = buf->uncompressed_pos, 
       .pos  = 0
     };
-    
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    // Keep compressing until entire input has been consumed
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    do {
-      size_t rem = ZSTD_compressStream2(buf->cctx, &(buf->zstd_buffer), &input, ZSTD_e_continue);
-      if (ZSTD_isError(rem)) {
-        Rprintf("write_bytes_to_stream() [A]: error %s\n", ZSTD_getErrorName(rem));
-      }
-    } while (input.pos != input.size);
-    
-    
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    // Reset the uncompressed data buffer
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    compress_to_stream(buf, &input, ZSTD_e_continue);
     buf->uncompressed_pos = 0;
     
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    // Check length of new seriazlization data. If larger than the buffer
-    // we allocated for uncompressed data, then compress data directly and return
-    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    if (length >= buf->uncompressed_size) {
+    if ((size_t)length >= INSIZE) {
       ZSTD_inBuffer input = {
         .src  = src, 
         .size = (size_t)length, 
         .pos  = 0
       };
-      
-      do {
-        size_t rem = ZSTD_compressStream2(buf->cctx, &(buf->zstd_buffer), &input, ZSTD_e_continue);
-        if (ZSTD_isError(rem)) {
-          Rprintf("write_bytes_to_stream() [A]: error %s\n", ZSTD_getErrorName(rem));
-        }
-      } while (input.pos != input.size);
-      
+      compress_to_stream(buf, &input, ZSTD_e_continue);
       return;
     }
   }
   
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Copy the supplied bytes to the uncompressed_data buffer
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   memcpy(buf->uncompressed_data + buf->uncompressed_pos, src, (size_t)length);
   buf->uncompressed_pos += (size_t)length;
 }
 
 
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Serialize an R object to a buffer of fixed size and then compress
-// the buffer using zstd
+// Serialize and compress.
+// Called via 'R_ExecWithCleanup()' so an internally created context is 
+// freed even if serialization raises an error (or is interrupted)
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_serialize_stream_(SEXP robj, SEXP cctx_, SEXP opts_) {
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Create the buffer for the serialized representation
-  // Calculate the exact size of the serialized object in bytes
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t num_serialized_bytes = (size_t)calc_serialized_size(robj);
-  serialize_stream_buffer_t buf = {
-    .uncompressed_pos  = 0,
-    .uncompressed_size = INSIZE
-  };
+static SEXP serialize_stream_data(void *data) {
+  serialize_stream_buffer_t *buf = (serialize_stream_buffer_t *)data;
   
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Initialize the ZSTD context
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (isNull(cctx_)) {
-    buf.cctx = init_cctx_with_opts(opts_, 0, 0);  // streaming does NOT have stable buffers.
-  } else {
-    buf.cctx = external_ptr_to_zstd_cctx(cctx_);
-  }
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // For streaming, need to explicitly set the number of serialized bytes
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t res = ZSTD_CCtx_setPledgedSrcSize(buf.cctx, num_serialized_bytes);
-  if (ZSTD_isError(res)) {
-    error("zstd_serialize_stream(): Error on pledge size\n");
-  }
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // calculate maximum possible size of compressed buffer in the worst case
-  // Allocate compression buffer
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t max_compressed_bytes  = ZSTD_compressBound(num_serialized_bytes);
-  SEXP dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)max_compressed_bytes));
-  char *dst = (char *)RAW(dst_);
-
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Setup destination for zstd compressed data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  buf.zstd_buffer.dst  = dst;
-  buf.zstd_buffer.size = max_compressed_bytes;
-  buf.zstd_buffer.pos  = 0;
+  init_growable_buffer(&buf->out, ZSTD_CStreamOutSize());
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Setup the R serialization struct
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   struct R_outpstream_st output_stream;
   R_InitOutPStream(
-    &output_stream,          // The stream object which wraps everything
-    (R_pstream_data_t) &buf, // The actual serialized data. R_pstream_data_t = void *
-    R_pstream_binary_format, // Store as binary
-    3,                       // Version = 3 for R >3.5.0 See `?base::serialize`
-    write_byte_to_stream,    // Function to write single byte to buffer
-    write_bytes_to_stream,   // Function for writing multiple bytes to buffer
-    NULL,                    // Func for special handling of reference data.
-    R_NilValue               // Data related to reference data handling
+    &output_stream,                // The stream object which wraps everything
+    (R_pstream_data_t) buf,        // The actual serialized data. R_pstream_data_t = void *
+    R_pstream_binary_format,       // Store as binary
+    3,                             // Version = 3 for R >3.5.0 See `?base::serialize`
+    write_byte_to_stream,          // Function to write single byte to buffer
+    write_bytes_to_stream,         // Function for writing multiple bytes to buffer
+    NULL,                          // Func for special handling of reference data.
+    R_NilValue                     // Data related to reference data handling
   );
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Serialize the object into the output_stream
+  // Serialize the object into the output_stream, and end the frame 
+  // with whatever is left in the buffer
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  R_Serialize(robj, &output_stream);
+  R_Serialize(buf->robj_, &output_stream);
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Compress the remaining serialized data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   ZSTD_inBuffer input = { 
-    .src  = buf.uncompressed_data, 
-    .size = buf.uncompressed_pos, 
-    .pos  = 0 
+    .src  = buf->uncompressed_data, 
+    .size = buf->uncompressed_pos, 
+    .pos  = 0
   };
+  compress_to_stream(buf, &input, ZSTD_e_end);
   
-  size_t remaining_bytes;
-  do {
-    remaining_bytes = ZSTD_compressStream2(buf.cctx, &(buf.zstd_buffer), &input, ZSTD_e_end);
-    if (ZSTD_isError(remaining_bytes)) {
-      error("zstd_compress() [end]: Compression error. %s", ZSTD_getErrorName(remaining_bytes));
-    }
-  } while (remaining_bytes > 0);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // How many compressed bytes did we generate?
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t num_compressed_bytes = buf.zstd_buffer.pos;
-
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Truncate the user-viewable size of the RAW vector
-  // Requires: R_VERSION >= R_Version(3, 4, 0)
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (num_compressed_bytes < max_compressed_bytes) {
-    SETLENGTH(dst_, (R_xlen_t)num_compressed_bytes);
-    SET_TRUELENGTH(dst_, (R_xlen_t)max_compressed_bytes);
-    SET_GROWABLE_BIT(dst_);
-  }
-  
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (isNull(cctx_)) ZSTD_freeCCtx(buf.cctx);
+  SEXP dst_ = finish_growable_buffer(&buf->out, 1);
   UNPROTECT(1);
   return dst_;
 }
 
 
+static void serialize_stream_cleanup(void *data) {
+  serialize_stream_buffer_t *buf = (serialize_stream_buffer_t *)data;
+  if (!buf->user_cctx) ZSTD_freeCCtx(buf->cctx);
+}
 
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize an R object, compressing the serialized bytes as they 
+// are written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_serialize_stream_(SEXP robj, SEXP cctx_, SEXP opts_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Uncompressed data is freed by R at the end of the .Call()
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  serialize_stream_buffer_t buf = {
+    .robj_             = robj,
+    .user_cctx         = !isNull(cctx_),
+    .uncompressed_data = (unsigned char *)R_alloc(INSIZE, 1),
+    .uncompressed_pos  = 0
+  };
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Initialize the ZSTD context
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (buf.user_cctx) {
+    buf.cctx = external_ptr_to_zstd_cctx(cctx_);
+  } else {
+    buf.cctx = init_cctx_with_opts(opts_, 0, 0);  // streaming does NOT have stable buffers.
+  }
+  ZSTD_CCtx_reset(buf.cctx, ZSTD_reset_session_only);
+  
+  return R_ExecWithCleanup(serialize_stream_data, &buf, serialize_stream_cleanup, &buf);
+}
@@ -12,13 +12,21 @@
 
 #include "zstd/zstd.h"
 #include "buffer-static.h"
-#include "calc-size-robust.h"
+#include "buffer-chunked.h"
+#include "buffer-growable.h"
 #include "cctx.h"
 #include "dctx.h"
+#include "dict-objects.h"
 #include "utils.h"
 #include "serialize-file.h"
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the first chunk of the serialization buffer.  
+// Later chunks double in size.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define SERIALIZE_CHUNK_SIZE 65536
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // ZSTDLIB_API const char* ZSTD_versionString(void)
@@ -29,71 +37,133 @@ SEXP zstd_version_(void) {
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Serialize an R object to a compressed raw vector
+// State for 'zstd_serialize_data()'.
+// 'buf' and an internally created 'cctx' are freed by 'zstd_serialize_cleanup()'
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_serialize_(SEXP robj_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_) {
+typedef struct {
+  SEXP robj_;
+  ZSTD_CCtx *cctx;
+  int user_cctx;
+  int stable_buffers;  // set on the user's context, so must be unset
+  chunked_buffer_t *buf;
+  size_t dst_capacity;
+  size_t num_compressed_bytes;
+} serialize_args_t;
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // If 'file_' is set, then use streaming interface
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (!isNull(file_) && asLogical(use_file_streaming_)) {
-    return zstd_serialize_stream_file_(robj_, file_, cctx_, opts_);
-  }
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize 'robj_' and compress it into a raw vector of the maximum 
+// compressed size.
+//
+// Called via 'R_ExecWithCleanup()', as 'R_Serialize()' or an R allocation 
+// can raise an error (or be interrupted) while the buffer holds the 
+// entire serialized object.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_serialize_data(void *data) {
+  serialize_args_t *args = (serialize_args_t *)data;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Create the buffer for the serialized representation
+  // Create the buffer for the serialized representation.
+  // This buffer grows as needed, so the object only needs to be 
+  // serialized once.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t src_size = (size_t)calc_serialized_size(robj_);
-  static_buffer_t *buf = init_buffer(src_size);
+  args->buf = init_chunked_buffer(SERIALIZE_CHUNK_SIZE);
+  chunked_buffer_t *buf = args->buf;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Create the R serialization structure
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   struct R_outpstream_st output_stream;
   R_InitOutPStream(
-    &output_stream,          // The stream object which wraps everything
-    (R_pstream_data_t) buf,  // The actual data
-    R_pstream_binary_format, // Store as binary
-    3,                       // Version = 3 for R >3.5.0 See `?base::serialize`
-    write_byte,              // Function to write single byte to buffer
-    write_bytes,             // Function for writing multiple bytes to buffer
-    NULL,                    // Func for special handling of reference data.
-    R_NilValue               // Data related to reference data handling
+    &output_stream,                // The stream object which wraps everything
+    (R_pstream_data_t) buf,        // The actual data
+    R_pstream_binary_format,       // Store as binary
+    3,                             // Version = 3 for R >3.5.0 See `?base::serialize`
+    write_byte_to_chunked_buffer,  // Function to write single byte to buffer
+    write_bytes_to_chunked_buffer, // Function for writing multiple bytes to buffer
+    NULL,                          // Func for special handling of reference data.
+    R_NilValue                     // Data related to reference data handling
   );
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Serialize the object into the output_stream
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  R_Serialize(robj_, &output_stream);
-
+  R_Serialize(args->robj_, &output_stream);
+  size_t src_size = buf->total;
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // calculate maximum possible size of compressed buffer in the worst case
   // And allocate the buffer
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t dstCapacity  = ZSTD_compressBound(src_size);
-  SEXP dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)dstCapacity));
+  args->dst_capacity = ZSTD_compressBound(src_size);
+  SEXP dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)args->dst_capacity));
   char *dst = (char *)RAW(dst_);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Compression Context
+  // If the serialized data fit in a single chunk, then it is contiguous
+  // and can be compressed in one call with stable buffers.
+  // Otherwise stream the chunks through the compressor.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  ZSTD_CCtx* cctx;
-  if (isNull(cctx_)) {
-    cctx = init_cctx_with_opts(opts_, 1, 0); // stable_buffers = 1
+  if (buf->head == buf->tail) {
+    args->stable_buffers = args->user_cctx;
+    cctx_set_stable_buffers(args->cctx);
+    args->num_compressed_bytes = ZSTD_compress2(args->cctx, dst, args->dst_capacity, buf->head->data, src_size);
   } else {
-    cctx = external_ptr_to_zstd_cctx(cctx_);
-    cctx_set_stable_buffers(cctx);
+    args->num_compressed_bytes = compress_chunked_buffer(args->cctx, buf, dst, args->dst_capacity);
   }
+  
+  UNPROTECT(1);
+  return dst_;
+}
+
+
+static void zstd_serialize_cleanup(void *data) {
+  serialize_args_t *args = (serialize_args_t *)data;
+  
+  if (args->buf != NULL) free_chunked_buffer(args->buf);
+  if (!args->user_cctx) {
+    ZSTD_freeCCtx(args->cctx);
+  } else if (args->stable_buffers) {
+    // Parameters can only be changed at the start of a frame
+    ZSTD_CCtx_reset(args->cctx, ZSTD_reset_session_only);
+    cctx_unset_stable_buffers(args->cctx);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize an R object to a compressed raw vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_serialize_(SEXP robj_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_file_streaming_) {
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Compress
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~  
-  size_t num_compressed_bytes = ZSTD_compress2(cctx, dst, dstCapacity, buf->data, src_size);
-  if (isNull(cctx_))  {
-    ZSTD_freeCCtx(cctx);
+  // If 'file_' is set, then use streaming interface
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!isNull(file_) && asLogical(use_file_streaming_)) {
+    return zstd_serialize_stream_file_(robj_, file_, cctx_, opts_);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compression Context.  
+  // Created first, so bad options are reported before serializing
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  serialize_args_t args = {
+    .robj_     = robj_,
+    .user_cctx = !isNull(cctx_)
+  };
+  if (args.user_cctx) {
+    args.cctx = external_ptr_to_zstd_cctx(cctx_);
   } else {
-    cctx_unset_stable_buffers(cctx);
+    args.cctx = init_cctx_with_opts(opts_, 0, 0);
   }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Serialize and compress
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~  
+  SEXP dst_ = PROTECT(R_ExecWithCleanup(zstd_serialize_data, &args, zstd_serialize_cleanup, &args));
+  char *dst = (char *)RAW(dst_);
+  size_t dstCapacity          = args.dst_capacity;
+  size_t num_compressed_bytes = args.num_compressed_bytes;
   if (ZSTD_isError(num_compressed_bytes)) {
     error("zstd_serialize_(): Compression error. %s", ZSTD_getErrorName(num_compressed_bytes));
   }
@@ -135,8 +205,6 @@ SEXP zstd_serialize_(SEXP robj_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_fi
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  free(buf->data);
-  free(buf);
   UNPROTECT(1);
   return dst_;
 }
@@ -144,67 +212,145 @@ SEXP zstd_serialize_(SEXP robj_, SEXP file_, SEXP cctx_, SEXP opts_, SEXP use_fi
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Unpack a raw vector to an R object
+// Arguments for 'zstd_unserialize_src()' and 'zstd_unserialize_decompress()'
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstd_unserialize_(SEXP src_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_) {
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // if 'src_' is a filename, then handle it with the streaming interface
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP src_;
   unsigned char *src;
   size_t src_size;
-  if (TYPEOF(src_) == STRSXP) {
-    if (asLogical(use_file_streaming_)) {
-      return zstd_unserialize_stream_file_(src_, dctx_, opts_);
-    } else {
-      src = read_file(CHAR(STRING_ELT(src_, 0)), &src_size);
-    }
-  } else {
-    src = RAW(src_);
-    src_size = (size_t)length(src_);
-  }
+  ZSTD_DCtx *dctx;
+  SEXP dctx_;
+  SEXP opts_;
+} unserialize_args_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress all frames into a raw vector.
+// For a file this is called via 'with_mapped_file()', so the mapping is
+// released even if an R error is raised here.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_unserialize_decompress(void *data) {
+  unserialize_args_t *args = (unserialize_args_t *)data;
+  unsigned char *src = args->src;
+  size_t src_size    = args->src_size;
+  ZSTD_DCtx *dctx    = args->dctx;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Find the number of bytes of compressed data in the frame
-  // ZSTDLIB_API size_t ZSTD_findFrameCompressedSize(const void* src, size_t srcSize);
+  // Determine the final decompressed size in number of bytes, summed
+  // over all frames
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t compressedSize = ZSTD_findFrameCompressedSize(src, src_size);
+  unsigned long long contentSize = ZSTD_findDecompressedSize(src, src_size);
+  if (contentSize == ZSTD_CONTENTSIZE_ERROR) {
+    error("zstd_unserialize(): Invalid or truncated zstd compressed data");
+  }
+  
+  if (use_dict_registry(args->dctx_, args->opts_)) {
+    dctx_select_registered_dict(dctx, src, src_size);
+  }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Determine the final decompressed size in number of bytes
-  // and allocate a decompression buffer
+  // Decompress
+  //
+  // If the size is known, decompress into a buffer of exactly that size.
+  // Otherwise decompress in a single pass into a buffer which grows 
+  // as needed.  Both are protected R raw vectors, so are not leaked if
+  // unserialization raises an error.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t dstCapacity = ZSTD_getFrameContentSize(src, compressedSize);
-  void *dst = malloc(dstCapacity);
-  if (dst == NULL) {
-    error("zstd_unserialize(): Could not allocation decompression buffer\n");
+  SEXP dst_;
+  size_t status;
+  
+  if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN) {
+    dst_ = PROTECT(allocVector(RAWSXP, (R_xlen_t)contentSize));
+    dctx_set_stable_buffers(dctx);
+    status = ZSTD_decompressDCtx(dctx, RAW(dst_), (size_t)contentSize, src, src_size);
+  } else {
+    growable_buffer_t gbuf;
+    init_growable_buffer(&gbuf, growable_initial_capacity(contentSize, src_size));
+    dctx_unset_stable_buffers(dctx);
+    
+    ZSTD_inBuffer input = {
+      .src  = src,
+      .size = src_size,
+      .pos  = 0
+    };
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    status = decompress_stream_growable(dctx, &gbuf, &input);
+    if (!ZSTD_isError(status)) {
+      status = decompress_stream_growable_end(dctx, &gbuf, status);
+    }
+    if (status != 0 && !ZSTD_isError(status)) {
+      error("zstd_unserialize(): Compressed data is truncated");
+    }
+    dst_ = finish_growable_buffer(&gbuf, 1);
+  }
+  
+  if (ZSTD_isError(status)) {
+    error("zstd_unserialize(): De-compression error. %s", ZSTD_getErrorName(status));
+  }
+  
+  UNPROTECT(1);
+  return dst_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a raw vector or a mapped file.
+// Called via 'with_dctx()', so an internally created context is freed 
+// even if an R error is raised here.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_unserialize_src(void *data) {
+  unserialize_args_t *args = (unserialize_args_t *)data;
+  
+  if (TYPEOF(args->src_) == STRSXP) {
+    mapped_file_t mf = { 0 };
+    map_file(CHAR(STRING_ELT(args->src_, 0)), &mf);
+    args->src      = mf.data;
+    args->src_size = mf.size;
+    return with_mapped_file(zstd_unserialize_decompress, args, &mf);
   }
+  
+  args->src      = RAW(args->src_);
+  args->src_size = (size_t)xlength(args->src_);
+  return zstd_unserialize_decompress(args);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack a raw vector to an R object
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_unserialize_(SEXP src_, SEXP dctx_, SEXP opts_, SEXP use_file_streaming_) {
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Decompression context
+  // if 'src_' is a filename, then handle it with the streaming interface
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  ZSTD_DCtx *dctx;
+  if (TYPEOF(src_) == STRSXP && asLogical(use_file_streaming_)) {
+    return zstd_unserialize_stream_file_(src_, dctx_, opts_);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decompression context.  
+  // Created before mapping the file, as bad options raise an R error. 
+  // Stable buffers are set once the content size is known.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unserialize_args_t args = {
+    .src_  = src_,
+    .dctx_ = dctx_,
+    .opts_ = opts_
+  };
   if (isNull(dctx_)) {
-    dctx = init_dctx_with_opts(opts_, 1, 0);  // Has a stable buffer
+    args.dctx = init_dctx_with_opts(opts_, 0, 0);
   } else {
-    dctx = external_ptr_to_zstd_dctx(dctx_);
-    dctx_set_stable_buffers(dctx);
+    args.dctx = external_ptr_to_zstd_dctx(dctx_);
   }
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Decompress
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t status = ZSTD_decompressDCtx(dctx, dst, dstCapacity, src, compressedSize);
-  if (ZSTD_isError(status)) {
-    error("zstd_unserialize(): De-compression error. %s", ZSTD_getErrorName(status));
-  }
+  SEXP dst_ = PROTECT(with_dctx(zstd_unserialize_src, &args, args.dctx, dctx_));
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Create a buffer structure to coordinate the input data
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   static_buffer_t buf = {
-    .data   = dst,
-    .length = dstCapacity,
+    .data   = RAW(dst_),
+    .length = (size_t)xlength(dst_),
     .pos    = 0
   };
     
@@ -231,11 +377,7 @@ SEXP zstd_unserialize_(SEXP src_, SEXP dctx_, SEXP opts_, SEXP use_file_streamin
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (TYPEOF(src_) == STRSXP) {
-    // We decoded from a file buffer. Free the buffer
-    free(src);
-  }
-  UNPROTECT(1);
+  UNPROTECT(2);
   return res_;
 }
 
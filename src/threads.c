@@ -0,0 +1,156 @@
+
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef __EMSCRIPTEN__
+#include <pthread.h>
+#endif
+
+#include "threads.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// This file contains a minimal pool of pthreads for processing a batch
+// of independent items e.g. compressing each element of a list.
+//
+// Workers take the next unprocessed item from a shared counter, so 
+// items of uneven size are balanced across threads.  
+// The calling thread acts as worker 0.
+//
+// Multithreading is not available on Emscripten (matching the bundled 
+// zstd library), and batches are then processed on the calling thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Number of threads to use for a batch.
+// Reads the 'num_threads' option from the user's 'opts' list and limits 
+// it to the number of items
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int batch_num_threads(SEXP opts_, size_t nitems) {
+  int num_threads = 1;
+  
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (isNewList(opts_) && !isNull(nms_)) {
+    for (int i = 0; i < length(opts_); i++) {
+      if (strcmp(CHAR(STRING_ELT(nms_, i)), "num_threads") == 0) {
+        num_threads = asInteger(VECTOR_ELT(opts_, i));
+      }
+    }
+  }
+  
+  if (num_threads == NA_INTEGER || num_threads < 1) num_threads = 1;
+  if ((size_t)num_threads > nitems) num_threads = nitems > 0 ? (int)nitems : 1;
+  
+#ifdef __EMSCRIPTEN__
+  num_threads = 1;
+#endif
+  
+  return num_threads;
+}
+
+
+#ifndef __EMSCRIPTEN__
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// State shared by all workers in a batch
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  pthread_mutex_t mutex;
+  size_t next;
+  size_t nitems;
+  batch_fn_t fn;
+  void *data;
+} batch_t;
+
+typedef struct {
+  batch_t *batch;
+  int worker;
+} worker_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Worker loop: process items until there are none left
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *batch_worker(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  batch_t *batch = w->batch;
+  
+  while (1) {
+    pthread_mutex_lock(&batch->mutex);
+    size_t item = batch->next++;
+    pthread_mutex_unlock(&batch->mutex);
+    
+    if (item >= batch->nitems) break;
+    batch->fn(batch->data, w->worker, item);
+  }
+  
+  return NULL;
+}
+
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Process 'nitems' items using 'num_threads' threads (including the 
+// calling thread).  Returns when all items are processed.
+//
+// If a thread cannot be started, the remaining workers (at least the 
+// calling thread) process all the items.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void run_batch(size_t nitems, int num_threads, batch_fn_t fn, void *data) {
+  
+#ifndef __EMSCRIPTEN__
+  if (num_threads > 1 && nitems > 1) {
+    batch_t batch = {
+      .next   = 0,
+      .nitems = nitems,
+      .fn     = fn,
+      .data   = data
+    };
+    pthread_mutex_init(&batch.mutex, NULL);
+    
+    pthread_t *threads = (pthread_t *)malloc((size_t)num_threads * sizeof(pthread_t));
+    worker_t  *workers = (worker_t  *)malloc((size_t)num_threads * sizeof(worker_t));
+    if (threads == NULL || workers == NULL) {
+      free(threads);
+      free(workers);
+      pthread_mutex_destroy(&batch.mutex);
+      error("run_batch(): Could not allocate threads");
+    }
+    
+    int nstarted = 0;
+    for (int i = 1; i < num_threads; i++) {
+      workers[i].batch  = &batch;
+      workers[i].worker = i;
+      if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0) {
+        break;
+      }
+      nstarted = i;
+    }
+    
+    workers[0].batch  = &batch;
+    workers[0].worker = 0;
+    batch_worker(&workers[0]);
+    
+    for (int i = 1; i <= nstarted; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    
+    free(threads);
+    free(workers);
+    pthread_mutex_destroy(&batch.mutex);
+    return;
+  }
+#endif
+  
+  for (size_t i = 0; i < nitems; i++) {
+    fn(data, 0, i);
+  }
+}
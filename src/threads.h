@@ -0,0 +1,14 @@
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Function called by a worker to process a single item in a batch.
+//   'data'    user data shared by all workers
+//   'worker'  index of the worker thread [0, num_threads)
+//   'item'    index of the item to process [0, nitems)
+//
+// This function runs outside the main R thread, and must not call 
+// any R API functions (including error() and warning())
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef void (*batch_fn_t)(void *data, int worker, size_t item);
+
+int batch_num_threads(SEXP opts_, size_t nitems);
+void run_batch(size_t nitems, int num_threads, batch_fn_t fn, void *data);
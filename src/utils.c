@@ -1,11 +1,86 @@
+#ifdef _WIN32
+#include <windows.h>  // Must be included before R headers
+#include <io.h>
+#endif
+
 #include <R.h>
 #include <Rinternals.h>
 #include <Rdefines.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+
+#include "utils.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Seek within an open file and report the resulting position.
+// Returns -1 on failure.
+//
+// 'fseek()'/'ftell()' use a 'long' which is only 32 bits on Windows, so use
+// the 64-bit variants to support files larger than 2GB
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+long long seek_file(FILE *fp, long long offset, int whence) {
+#ifdef _WIN32
+  if (_fseeki64(fp, offset, whence) != 0) return -1;
+  return _ftelli64(fp);
+#else
+  if (fseeko(fp, (off_t)offset, whence) != 0) return -1;
+  return (long long)ftello(fp);
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Truncate an open file to 'size' bytes.  Any buffered output is flushed
+// first.  Returns -1 on failure.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int truncate_file(FILE *fp, long long size) {
+  if (fflush(fp) != 0) return -1;
+#ifdef _WIN32
+  return _chsize_s(_fileno(fp), size) == 0 ? 0 : -1;
+#else
+  return ftruncate(fileno(fp), (off_t)size) == 0 ? 0 : -1;
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of an open file in bytes.  File position is reset to the start.
+// Returns -1 on failure.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static long long file_size_quiet(FILE *fp) {
+  long long fsize = seek_file(fp, 0, SEEK_END);
+  rewind(fp);
+  return fsize;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of an open file in bytes. Raises an R error on failure.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t file_size(FILE *fp, const char *filename) {
+  long long fsize = file_size_quiet(fp);
+  
+  if (fsize < 0) {
+    fclose(fp);
+    error("file_size(): Couldn't determine size of '%s'", filename);
+  }
+  
+  return (size_t)fsize;
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Read a file into a memory buffer.  Caller is responsible for freeing memory
 //
@@ -17,9 +92,7 @@
 unsigned char *read_file(const char *filename, size_t *src_size) {
   FILE *fp = fopen(filename, "rb");
   if (fp == NULL) error("read_file(): Couldn't open file '%s'", filename);
-  fseek(fp, 0, SEEK_END);
-  size_t fsize = (size_t)ftell(fp);
-  fseek(fp, 0, SEEK_SET);  /* same as rewind(f); */
+  size_t fsize = file_size(fp, filename);
   
   unsigned char *buf = malloc(fsize);
   if (buf == NULL) {
@@ -41,34 +114,198 @@ unsigned char *read_file(const char *filename, size_t *src_size) {
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Read a file into a memory buffer.  Caller is responsible for freeing memory
 //
+// Unlike 'read_file()', this does not call any R API functions, so is
+// safe to call from a worker thread.
+//
 // @param filename full filename
-// @param max_bytes maximum number of bytes to read
 // @param *src_size number of bytes read. returned to user
 //
-// @return pointer to allocated memory buffer with contents of file.
+// @return pointer to allocated memory buffer with contents of file, or
+//         NULL if the file could not be read
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-unsigned char *read_partial_file(const char *filename, size_t max_bytes, size_t *src_size) {
+unsigned char *read_file_quiet(const char *filename, size_t *src_size) {
   FILE *fp = fopen(filename, "rb");
-  if (fp == NULL) error("read_partial_file(): Couldn't open file '%s'", filename);
-  fseek(fp, 0, SEEK_END);
-  *src_size = (size_t)ftell(fp);
-  fseek(fp, 0, SEEK_SET);  /* same as rewind(f); */
+  if (fp == NULL) return NULL;
+  
+  long long fsize = file_size_quiet(fp);
+  if (fsize < 0) {
+    fclose(fp);
+    return NULL;
+  }
   
-  unsigned char *buf = malloc(max_bytes);
+  unsigned char *buf = malloc(fsize > 0 ? (size_t)fsize : 1);
   if (buf == NULL) {
-    error("read_partial_file(): Could not allocate memory to read %zu bytes from '%s'", max_bytes, filename);
+    fclose(fp);
+    return NULL;
   }
   
-  size_t n = fread(buf, 1, max_bytes, fp);
+  size_t n = fread(buf, 1, (size_t)fsize, fp);
   fclose(fp);
   
-  if (n != max_bytes) {
-    error("read_partial_file(): fread() only read %zu/%zu bytes", n, max_bytes);
+  if (n != (size_t)fsize) {
+    free(buf);
+    return NULL;
   }
   
+  *src_size = (size_t)fsize;
   return buf;
-} 
+}
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map a file into memory (read-only).  Call 'unmap_file()' when done.
+//
+// Decompressing directly from the mapped pages avoids allocating a buffer 
+// the size of the file and copying the file into it.  The kernel is told 
+// that access will be sequential so it can read ahead aggressively.
+//
+// If the file cannot be mapped (e.g. empty file), then the file is read 
+// into memory with 'read_file_quiet()' instead.
+//
+// This does not call any R API functions, so is safe to call from a 
+// worker thread, or while holding memory which must be freed on error.
+//
+// @param filename full filename
+// @param mf mapped file struct to populate
+//
+// @return 0 on success. -1 if the file could not be opened or read
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int map_file_quiet(const char *filename, mapped_file_t *mf) {
+  mf->data      = NULL;
+  mf->size      = 0;
+  mf->is_mapped = 0;
+  
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+      mf->data      = (unsigned char *)data;
+      mf->size      = (size_t)st.st_size;
+      mf->is_mapped = 1;
+    }
+  }
+  close(fd);
+  
+  if (mf->is_mapped) return 0;
+#else
+  HANDLE fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (fh == INVALID_HANDLE_VALUE) return -1;
+  
+  LARGE_INTEGER fsize;
+  if (GetFileSizeEx(fh, &fsize) && fsize.QuadPart > 0) {
+    HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mh != NULL) {
+      void *data = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+      if (data != NULL) {
+        mf->data      = (unsigned char *)data;
+        mf->size      = (size_t)fsize.QuadPart;
+        mf->is_mapped = 1;
+      }
+      CloseHandle(mh);
+    }
+  }
+  CloseHandle(fh);
+  
+  if (mf->is_mapped) return 0;
+#endif
+  
+  mf->data = read_file_quiet(filename, &mf->size);
+  return mf->data == NULL ? -1 : 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map a file into memory (read-only).  Call 'unmap_file()' when done.
+// Raises an R error if the file cannot be read.
+//
+// @param filename full filename
+// @param mf mapped file struct to populate
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void map_file(const char *filename, mapped_file_t *mf) {
+  if (map_file_quiet(filename, mf) != 0) {
+    error("map_file(): Couldn't read file '%s'", filename);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Release memory from 'map_file()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void unmap_file(mapped_file_t *mf) {
+  if (mf->data == NULL) return;
+  
+  if (mf->is_mapped) {
+#ifndef _WIN32
+    munmap(mf->data, mf->size);
+#else
+    UnmapViewOfFile(mf->data);
+#endif
+    mf->data = NULL;
+    return;
+  }
+  
+  free(mf->data);
+  mf->data = NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Call 'fun(data)' while a file is mapped, and release the mapping 
+// afterwards.  The mapping is also released if 'fun' raises an R error 
+// (including a failed R allocation), so 'fun' doesn't need to unmap it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void unmap_file_cleanup(void *data) {
+  unmap_file((mapped_file_t *)data);
+}
+
+SEXP with_mapped_file(SEXP (*fun)(void *), void *data, mapped_file_t *mf) {
+  return R_ExecWithCleanup(fun, data, unmap_file_cleanup, mf);
+}
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create a CHARSXP from decompressed bytes.
+//
+// As with 'readLines()', the string is truncated at an embedded nul (which
+// a CHARSXP can't hold) and '*truncated' is set so the caller can warn once.
+// A string longer than INT_MAX bytes raises an error naming 'func', so only
+// call this when nothing else needs to be released.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP mkchar_nul_truncated(const char *str, size_t len, const char *func, int *truncated) {
+  const char *nul = memchr(str, '\0', len);
+  if (nul != NULL) {
+    len = (size_t)(nul - str);
+    *truncated = 1;
+  }
+  if (len > INT_MAX) {
+    error("%s: Decompressed data is too large for a string (%.0f bytes). Use type = 'raw'",
+          func, (double)len);
+  }
+  return mkCharLen(str, (int)len);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Seconds from a monotonic clock.  Only differences between two calls are
+// meaningful.  Unlike wall-clock time, this never jumps backwards.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double monotonic_seconds(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
@@ -1,2 +1,25 @@
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The contents of a file, either memory-mapped or read into a malloc'd buffer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  int is_mapped;
+} mapped_file_t;
+
+
+long long seek_file(FILE *fp, long long offset, int whence);
+int truncate_file(FILE *fp, long long size);
+
 unsigned char *read_file(const char *filename, size_t *src_size); 
-unsigned char *read_partial_file(const char *filename, size_t max_bytes, size_t *src_size);
+unsigned char *read_file_quiet(const char *filename, size_t *src_size);
+int map_file_quiet(const char *filename, mapped_file_t *mf);
+void map_file(const char *filename, mapped_file_t *mf);
+void unmap_file(mapped_file_t *mf);
+SEXP with_mapped_file(SEXP (*fun)(void *), void *data, mapped_file_t *mf);
+
+SEXP mkchar_nul_truncated(const char *str, size_t len, const char *func, int *truncated);
+
+double monotonic_seconds(void);
@@ -0,0 +1,122 @@
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "zstd.h"
+#include "utils.h"
+#include "seekable.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// State for 'zstd_index_build()'.  'index' is freed by 'zstd_index_cleanup()'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  const char *filename;
+  SEXP dst_;
+  seek_index_t index;
+  mapped_file_t mf;
+} index_args_t;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Walk the frames of the mapped file.  
+// Called via 'with_mapped_file()', as an invalid frame raises an R error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_index_scan(void *data) {
+  index_args_t *args = (index_args_t *)data;
+  seek_index_scan(&args->index, args->mf.data, args->mf.size);
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find the frames, write the sidecar file and create the result
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP zstd_index_build(void *data) {
+  index_args_t *args = (index_args_t *)data;
+  seek_index_t *index = &args->index;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Seek table
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  FILE *fp = fopen(args->filename, "rb");
+  if (fp == NULL) {
+    error("zstd_index_(): Couldn't open file '%s'", args->filename);
+  }
+  int found = seek_index_read_table(index, fp);
+  fclose(fp);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Otherwise walk the frames.  Only the frame and block headers are 
+  // touched, unless a frame has no content size.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!found) {
+    map_file(args->filename, &args->mf);
+    with_mapped_file(zstd_index_scan, args, &args->mf);
+  }
+  
+  if (!isNull(args->dst_)) {
+    seek_index_write_file(index, CHAR(STRING_ELT(args->dst_, 0)));
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Offsets as doubles, as files may be larger than 2GB
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP c_offset_ = PROTECT(allocVector(REALSXP, (R_xlen_t)index->n));
+  SEXP d_offset_ = PROTECT(allocVector(REALSXP, (R_xlen_t)index->n));
+  for (size_t i = 0; i < index->n; i++) {
+    REAL(c_offset_)[i] = (double)index->points[i].c_offset;
+    REAL(d_offset_)[i] = (double)index->points[i].d_offset;
+  }
+  
+  SEXP res_ = PROTECT(allocVector(VECSXP, 2));
+  SEXP nms_ = PROTECT(allocVector(STRSXP, 2));
+  SET_VECTOR_ELT(res_, 0, c_offset_);
+  SET_VECTOR_ELT(res_, 1, d_offset_);
+  SET_STRING_ELT(nms_, 0, mkChar("compressed_offset"));
+  SET_STRING_ELT(nms_, 1, mkChar("uncompressed_offset"));
+  setAttrib(res_, R_NamesSymbol, nms_);
+  
+  UNPROTECT(4);
+  return res_;
+}
+
+
+static void zstd_index_cleanup(void *data) {
+  seek_index_free(&((index_args_t *)data)->index);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Build an index of the frames in a compressed file.
+//
+// If the file has a seek table, it is used directly.  Otherwise the frames
+// are walked to find their offsets.
+//
+// @param src_ filename
+// @param dst_ filename for the sidecar index. Or NULL to not write a file.
+//
+// @return list of 'compressed_offset' and 'uncompressed_offset' for the
+//         start of every frame, and the end of the data.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP zstd_index_(SEXP src_, SEXP dst_) {
+  
+  if (TYPEOF(src_) != STRSXP) {
+    error("zstd_index_() only accepts a filename");
+  }
+  
+  index_args_t args = {
+    .filename = CHAR(STRING_ELT(src_, 0)),
+    .dst_     = dst_,
+    .mf       = { 0 }
+  };
+  seek_index_init(&args.index);
+  
+  // The index is freed even if an R error is raised
+  return R_ExecWithCleanup(zstd_index_build, &args, zstd_index_cleanup, &args);
+}
@@ -26,20 +26,23 @@ SEXP zstd_info_(SEXP src_) {
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   unsigned char *src;
   size_t src_size;
+  mapped_file_t mf = { 0 };
   
   if (TYPEOF(src_) == STRSXP) {
-    const char *filename = CHAR(STRING_ELT(src_, 0));
-    size_t max_bytes = 18; // maximum size of frame header: ZSTD_frameHeaderSize_max
-    src = read_partial_file(filename, max_bytes, &src_size);
+    // Only the pages holding the frame header are actually read from disk
+    map_file(CHAR(STRING_ELT(src_, 0)), &mf);
+    src      = mf.data;
+    src_size = mf.size;
   } else if (TYPEOF(src_) == RAWSXP) {
     src      = RAW(src_);
-    src_size = (size_t)length(src_);
+    src_size = (size_t)xlength(src_);
   } else {
     error("zstd_info_() currently only accepts raw vectors or filenames");
   }
   
   if (src_size < 18) {
     // warning("zstd_info_() probably not Zstandard compressed data");
+    unmap_file(&mf);
     return R_NilValue;
   }
   
@@ -59,6 +62,10 @@ SEXP zstd_info_(SEXP src_) {
   // } ZSTD_frameHeader;
   ZSTD_frameHeader fh;
   size_t res = ZSTD_getFrameHeader(&fh, src, src_size);
+  
+  // Only the header was needed
+  unmap_file(&mf);
+  
   if (ZSTD_isError(res)) {
     // warning("zstd_info_() probably not Zstandard compressed data (Error: %s)", ZSTD_getErrorName(res));
     return R_NilValue;
@@ -72,10 +79,15 @@ SEXP zstd_info_(SEXP src_) {
   SEXP res_ = PROTECT(allocVector(VECSXP, NINFO));
   SEXP nms_ = PROTECT(allocVector(STRSXP, NINFO));
   
-  SET_VECTOR_ELT(res_, 0, ScalarReal((double)fh.frameContentSize));
+  // Streaming compressors may not record the size in the frame header
+  if (fh.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+    SET_VECTOR_ELT(res_, 0, ScalarReal(NA_REAL));
+  } else {
+    SET_VECTOR_ELT(res_, 0, ScalarReal((double)fh.frameContentSize));
+  }
   SET_STRING_ELT(nms_, 0, mkChar("uncompressed_size"));
   
-  SET_VECTOR_ELT(res_, 1, ScalarInteger(src_size));
+  SET_VECTOR_ELT(res_, 1, ScalarReal((double)src_size));
   SET_STRING_ELT(nms_, 1, mkChar("compressed_size"));
   
   SET_VECTOR_ELT(res_, 2, ScalarInteger((int)fh.dictID));
@@ -18,6 +18,11 @@
 #include "zstd/zstd.h"
 #include "cctx.h"
 #include "dctx.h"
+#include "dict-objects.h"
+#include "utils.h"
+#include "seekable.h"
+#include "async-writer.h"
+#include "prefetch.h"
 
 
 // SEXP   R_new_custom_connection(
@@ -86,6 +91,11 @@
 #define  INSIZE 131702  
 #define OUTSIZE 131591  
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Number of OUTSIZE blocks of uncompressed data read ahead by 'prefetch'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define PREFETCH_BLOCKS 8
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // ZSTD state. 
 //   - This is user/private data stored with the 'Rconn' struct that gets 
@@ -103,6 +113,30 @@ typedef struct {
   FILE *fp; // The file containing zstd compresseddata
   Rconnection inner; // the connection to read/write to
   
+  // Compression output. Split into frames of 'frame_size' with a seek table
+  // if 'frame_size > 0'
+  size_t frame_size;
+  seekable_writer_t writer;
+  
+  // Compress on a background thread when writing to a file. Optional.
+  // When 'aw' is set, written data is buffered by 'aw' rather than in 
+  // 'uncompressed_data'
+  int async;
+  async_writer_t *aw;
+  
+  // Read and decompress ahead on a background thread when reading a file.
+  // Optional. While 'pf' is running, the worker owns 'fp', 'dctx', 
+  // 'compressed_*', 'produced_total' and 'index'
+  int prefetch;
+  prefetch_t *pf;
+  
+  // Flush compressed output after this many uncompressed bytes or seconds 
+  // since the last flush.  Checked on each write.  0 = never.
+  double flush_bytes;
+  double flush_interval;
+  double unflushed;      // uncompressed bytes written since the last flush
+  double last_flush;     // 'monotonic_seconds()' at the last flush
+  
   // Used by readLines()/fgetc()
   unsigned char uncompressed_data[OUTSIZE];
   size_t uncompressed_size;
@@ -114,6 +148,25 @@ typedef struct {
   size_t compressed_size;
   size_t compressed_pos;
   size_t compressed_len;
+  
+  // Position when reading from a file, and the known frame starts for seek()
+  uint64_t compressed_offset;  // file offset of 'compressed_data[0]'
+  uint64_t decompressed_total; // uncompressed bytes output by zstdfile_decompress()
+  uint64_t produced_total;     // uncompressed bytes decompressed from the file. 
+                               // Ahead of 'decompressed_total' when prefetching
+  seek_index_t index;
+  char *index_file;            // sidecar index created by zstd_index(). Optional
+  
+  // Dictionary selected from the registry by the first frame header.
+  // 'dict' is preserved while it is referenced by 'dctx'
+  int use_registry;
+  int select_dict;
+  SEXP dict;
+  
+  // Options used to create 'cctx'/'dctx'.  Preserved, as a 'zstd_cdict()' 
+  // or 'zstd_ddict()' in the options is only referenced by the contexts
+  SEXP opts;
+
 } zstd_state;
 
 
@@ -135,8 +188,10 @@ typedef struct {
 //    - "a+", "a+b"    Open for reading and appending.
 //
 // Notes:
-//   - Supported modes: r, rt, w, wt, rb, wb
-//   - unsupported modes: append, simultaneous read/write
+//   - Supported modes: r, rt, w, wt, rb, wb, a, at, ab
+//   - unsupported modes: simultaneous read/write
+//   - append adds new frames to the end of the file. Readers decompress
+//     the concatenated frames as a single stream.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 Rboolean zstdfile_open(struct Rconn *rconn) {
   
@@ -145,28 +200,35 @@ Rboolean zstdfile_open(struct Rconn *rconn) {
     error("zstdfile(): Connection is already open. Cannot open twice");
   }
   
-  if (strchr(rconn->mode, 'a') != NULL) {
-    error("zstdfile() does not support append.");
-  } else if (strchr(rconn->mode, '+') != NULL) {
+  if (strchr(rconn->mode, '+') != NULL) {
     error("zstdfile() does not support simultaneous r/w.");
   }
   
-  rconn->text   = strchr(rconn->mode, 'b') ? FALSE : TRUE;
-  rconn->isopen = TRUE;
-  
-  if (strchr(rconn->mode, 'w') == NULL) {
-    rconn->canread  =  TRUE;
-    rconn->canwrite = FALSE;
-  } else {
-    rconn->canread  = FALSE;
-    rconn->canwrite =  TRUE;
-  }
+  int append = strchr(rconn->mode, 'a') != NULL;
+  int canread = strchr(rconn->mode, 'w') == NULL && !append;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // State
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   zstd_state *zstate = (zstd_state *)rconn->private;
   
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Read the sidecar index first, as this raises an R error if the index 
+  // is missing or corrupt and nothing has been opened yet.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  seek_index_free(&zstate->index);
+  seek_index_init(&zstate->index);
+  
+  int use_index_file = canread && zstate->type == TOFILE && zstate->index_file != NULL;
+  if (use_index_file) {
+    seek_index_read_file(&zstate->index, zstate->index_file);
+  }
+  
+  rconn->text     = strchr(rconn->mode, 'b') ? FALSE : TRUE;
+  rconn->isopen   = TRUE;
+  rconn->canread  = canread;
+  rconn->canwrite = !canread;
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Setup file pointer or connection object
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -174,6 +236,12 @@ Rboolean zstdfile_open(struct Rconn *rconn) {
     FILE *fp;
     if (rconn->canread) {
       fp = fopen(rconn->description, "rb");
+    } else if (append) {
+      // "r+b" so an existing seek table can be overwritten. See 'seekable_writer_resume()'
+      fp = fopen(rconn->description, "r+b");
+      if (fp == NULL) {
+        fp = fopen(rconn->description, "wb");
+      }
     } else {
       fp = fopen(rconn->description, "wb");
     }
@@ -184,6 +252,8 @@ Rboolean zstdfile_open(struct Rconn *rconn) {
   } else {
     if (rconn->canread) {
       strncpy(zstate->inner->mode, "rb", 2);
+    } else if (append) {
+      strncpy(zstate->inner->mode, "ab", 2);
     } else {
       strncpy(zstate->inner->mode, "wb", 2);
     }
@@ -201,6 +271,53 @@ Rboolean zstdfile_open(struct Rconn *rconn) {
   
   ZSTD_DCtx_reset(zstate->dctx, ZSTD_reset_session_only);
   ZSTD_CCtx_reset(zstate->cctx, ZSTD_reset_session_only);
+  zstate->select_dict = zstate->use_registry && rconn->canread;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Seeking is supported when reading from a file. 
+  // Use the sidecar index (read above) or seek table if there is one, 
+  // otherwise frame starts are recorded as they are decompressed.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  zstate->compressed_offset  = 0;
+  zstate->decompressed_total = 0;
+  zstate->produced_total     = 0;
+  
+  rconn->canseek = rconn->canread && zstate->type == TOFILE;
+  if (use_index_file) {
+    long long fsize = seek_file(zstate->fp, 0, SEEK_END);
+    rewind(zstate->fp);
+    if (fsize < 0 || zstate->index.points[zstate->index.n - 1].c_offset != (uint64_t)fsize) {
+      fclose(zstate->fp);
+      zstate->fp    = NULL;
+      rconn->isopen = FALSE;
+      error("zstdfile(): Index '%s' does not match file '%s'", zstate->index_file, rconn->description);
+    }
+  } else if (rconn->canseek) {
+    seek_index_read_table(&zstate->index, zstate->fp);
+  }
+  
+  if (rconn->canwrite) {
+    if (zstate->type == TOFILE) {
+      seekable_writer_init(&zstate->writer, zstate->cctx, zstate->frame_size, 
+                           ZSTD_CONTENTSIZE_UNKNOWN, seekable_write_file, zstate->fp);
+      if (append && seekable_writer_resume(&zstate->writer, zstate->fp) < 0) {
+        seekable_writer_free(&zstate->writer);
+        fclose(zstate->fp);
+        zstate->fp    = NULL;
+        rconn->isopen = FALSE;
+        error("zstdfile(): Couldn't append to file '%s'", rconn->description);
+      }
+      if (zstate->async) {
+        // If the thread can't be started, just compress on the R thread
+        zstate->aw = async_writer_init(&zstate->writer, zstate->uncompressed_size);
+      }
+    } else {
+      seekable_writer_init(&zstate->writer, zstate->cctx, zstate->frame_size, 
+                           ZSTD_CONTENTSIZE_UNKNOWN, seekable_write_conn, zstate->inner);
+    }
+    zstate->unflushed  = 0;
+    zstate->last_flush = monotonic_seconds();
+  }
   
   return TRUE;
 }
@@ -216,48 +333,52 @@ void zstdfile_close(struct Rconn *rconn) {
   
   rconn->isopen = FALSE;
   zstd_state *zstate = (zstd_state *)rconn->private;
+  size_t res = 0;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Need to flush out and compress any remaining bytes
+  // Need to flush out and compress any remaining bytes.
+  // This includes any error from the background compression thread
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (rconn->canwrite) {
-    static unsigned char zstd_raw[OUTSIZE];
-    ZSTD_inBuffer input = { 
-      .src  = zstate->uncompressed_data, 
-      .size = zstate->uncompressed_pos, 
-      .pos  = 0 
-    };
-    
-    size_t remaining_bytes;
-    do {
-      ZSTD_outBuffer output = { 
-        .dst  = zstd_raw, 
-        .size = OUTSIZE, 
-        .pos  = 0 
-      };
-      remaining_bytes = ZSTD_compressStream2(zstate->cctx, &output, &input, ZSTD_e_end);
-      if (ZSTD_isError(remaining_bytes)) {
-        Rprintf("write_bytes_to_stream_file() [end]: error %s\n", ZSTD_getErrorName(remaining_bytes));
-      }
-      if (zstate->type == TOFILE) {
-        fwrite(output.dst, 1, output.pos, zstate->fp);
-      } else {
-        R_WriteConnection(zstate->inner,  output.dst, output.pos);
-      }
-    } while (remaining_bytes > 0);
+    if (zstate->aw != NULL) {
+      res = async_writer_finish(zstate->aw);
+      async_writer_free(zstate->aw);
+      zstate->aw = NULL;
+    } else {
+      res = seekable_writer_compress(&zstate->writer, zstate->uncompressed_data, zstate->uncompressed_pos);
+    }
+    if (!ZSTD_isError(res)) {
+      res = seekable_writer_end(&zstate->writer);
+    }
+    seekable_writer_free(&zstate->writer);
+    zstate->uncompressed_pos = 0;
   }
   
+  prefetch_free(zstate->pf);
+  zstate->pf = NULL;
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Close the file
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int close_failed = FALSE;
   if (zstate->type == TOFILE && zstate->fp) {
-    fclose(zstate->fp);
+    close_failed = fclose(zstate->fp) != 0;
     zstate->fp = NULL;  
   }
   if (zstate->type == TOCONN && zstate->inner) {
     zstate->inner->close(zstate->inner);
   }
   
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Report errors only once the connection is fully closed.  
+  // A warning, as an error here would leave R's connection half-closed
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (ZSTD_isError(res)) {
+    warning("zstdfile_close(): Compression error. %s. Data written to '%s' is incomplete", 
+            ZSTD_getErrorName(res), rconn->description);
+  } else if (close_failed && rconn->canwrite) {
+    warning("zstdfile_close(): Couldn't finish writing '%s'", rconn->description);
+  }
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -270,8 +391,15 @@ void zstdfile_destroy(struct Rconn *rconn) {
   if (DEBUG_ZSTDFILE) Rprintf("zstdfile_destroy()\n");
   
   zstd_state *zstate = (zstd_state *)rconn->private;
+  async_writer_free(zstate->aw);
+  prefetch_free(zstate->pf);
+  seekable_writer_free(&zstate->writer);
+  seek_index_free(&zstate->index);
+  free(zstate->index_file);
   if (!zstate->user_dctx && zstate->dctx != NULL) ZSTD_freeDCtx(zstate->dctx);
   if (!zstate->user_cctx && zstate->cctx != NULL) ZSTD_freeCCtx(zstate->cctx);
+  if (zstate->dict != R_NilValue) R_ReleaseObject(zstate->dict);
+  if (zstate->opts != NULL) R_ReleaseObject(zstate->opts);
   
   free(zstate); 
 }
@@ -284,15 +412,6 @@ int zstdfile_fgetc_internal(struct Rconn *rconn) {
   return rconn->fgetc(rconn);
 }
 
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// seek()
-//   - zstdfile() will not support seeking
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-double zstdfile_seek(struct Rconn *rconn, double x, int y, int z) {
-  error("zstdfile_seek() - not supported");
-  return 0;
-}
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // truncate
 //   - zstdfile() will not support truncation
@@ -301,29 +420,55 @@ void zstdfile_truncate(struct Rconn *rconn) {
   error("zstdfile_truncate() - not supported");
 }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress all data written so far and write it out with ZSTD_e_flush.
+// The frame is not ended, so the window is kept and later data still
+// compresses well.  Everything written so far can then be decompressed by
+// a reader of the file (e.g. following the end of a log).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_flush_writer(zstd_state *zstate) {
+  size_t res;
+  if (zstate->aw != NULL) {
+    res = async_writer_flush(zstate->aw);
+  } else {
+    res = seekable_writer_compress(&zstate->writer, zstate->uncompressed_data, zstate->uncompressed_pos);
+    zstate->uncompressed_pos = 0;
+    if (!ZSTD_isError(res)) {
+      res = seekable_writer_flush(&zstate->writer);
+    }
+  }
+  if (ZSTD_isError(res)) {
+    error("zstdfile_fflush(): error %s\n", ZSTD_getErrorName(res));
+  }
+  
+  if (zstate->type == TOFILE) {
+    fflush(zstate->fp);
+  } else if (zstate->inner->canwrite) {
+    zstate->inner->fflush(zstate->inner);
+  }
+  
+  zstate->unflushed  = 0;
+  zstate->last_flush = monotonic_seconds();
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // fflush
-//   - zstdfile will not suport flush()
-//   - a flush of buffers to file will only occur during 'close()'
+//   - Only has an effect when writing. 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 int zstdfile_fflush(struct Rconn *rconn) {
-  error("zstdfile_fflush() - not supported\n");
-  return 1;
+  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_fflush()\n");
+  
+  if (rconn->isopen && rconn->canwrite) {
+    zstdfile_flush_writer((zstd_state *)rconn->private);
+  }
+  return 0;
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// readBin()
+// If file read buffer is empty, then fill it
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn) {
-  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_read(size = %zu, nitems = %zu)\n", size, nitems);
-  
-  zstd_state *zstate = (zstd_state *)rconn->private;
-  
-  size_t len = size * nitems;
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // If file read buffer  is empty, then fill it
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_fill(zstd_state *zstate) {
   if (zstate->compressed_len == 0) {
     if (zstate->type == TOFILE) {
       zstate->compressed_len = fread(zstate->compressed_data, 1, zstate->compressed_size, zstate->fp);
@@ -332,16 +477,34 @@ size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn)
     }
     zstate->compressed_pos = 0;
   }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress up to 'len' bytes into 'dst'
+//
+// This does not call the R API when reading from a file, so it can be run 
+// by the prefetch worker.
+//
+// @param err set to a zstd error code on error
+// @param eof set to TRUE if the end of the compressed data was reached
+// @return number of bytes decompressed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t zstdfile_decompress_core(void *dst, size_t len, struct Rconn *rconn, size_t *err, int *eof) {
+  
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  zstdfile_fill(zstate);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // ZSTD input struct.
-  // Note: There may be multiple calls to 'read_bytes_from_stream_file()'
+  // Note: There may be multiple calls to 'zstdfile_decompress()'
   //       which are all consuming data from the same buffered read from file
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   ZSTD_inBuffer input   = { 
-    .src  = zstate->compressed_data + zstate->compressed_pos, 
-    .size = zstate->compressed_len  - zstate->compressed_pos, 
-    .pos  = 0
+    .src  = zstate->compressed_data, 
+    .size = zstate->compressed_len, 
+    .pos  = zstate->compressed_pos
   };
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -361,11 +524,24 @@ size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn)
   while (output.pos < len) {
     size_t const status = ZSTD_decompressStream(zstate->dctx, &output , &input);
     if (ZSTD_isError(status)) {
-      error("zstdfile_read() error: %s", ZSTD_getErrorName(status));
+      *err = status;
+      break;
     }
     
     // Update the compressed data pointer to where we have decompressed up to
-    zstate->compressed_pos += input.pos;
+    zstate->compressed_pos = input.pos;
+    
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // A status of 0 means a frame has been completely decoded and flushed,
+    // so the next frame starts exactly here.  Record it for seek()
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if (status == 0 && rconn->canseek) {
+      seek_index_add_quiet(
+        &zstate->index, 
+        zstate->compressed_offset + zstate->compressed_pos, 
+        zstate->produced_total    + output.pos
+      );
+    }
     
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // If the read file buffer (of compressed data) is exhausted: read more!
@@ -376,21 +552,23 @@ size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn)
       // file read buffer is exhausted. read more bytes
       if (zstate->type == TOFILE) {
         if (feof(zstate->fp)) {
-          rconn->EOF_signalled = TRUE;
+          *eof = TRUE;
           break;
         }
+        zstate->compressed_offset += zstate->compressed_len;
         zstate->compressed_len = fread(zstate->compressed_data, 1, zstate->compressed_size, zstate->fp);
       } else {
         if (zstate->inner->EOF_signalled) {
-          rconn->EOF_signalled = TRUE;
+          *eof = TRUE;
           break;
         }
+        zstate->compressed_offset += zstate->compressed_len;
         zstate->compressed_len = R_ReadConnection(zstate->inner, zstate->compressed_data, zstate->compressed_size);
       }
       zstate->compressed_pos = 0;
       
       if (zstate->compressed_len == 0) {
-        rconn->EOF_signalled = TRUE;
+        *eof = TRUE;
         break;
       }
       
@@ -400,15 +578,139 @@ size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn)
     }
   }
   
+  zstate->produced_total += output.pos;
+  
   return output.pos;
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress the next block for the prefetch ring.  Runs on the worker.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t zstdfile_prefetch_fn(void *data, void *dst, size_t capacity, size_t *err) {
+  int eof = FALSE;
+  return zstdfile_decompress_core(dst, capacity, (struct Rconn *)data, err, &eof);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Stop the prefetch worker.  Data decompressed but not yet read is 
+// discarded, so the file state may now be ahead of the read position.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_prefetch_stop(zstd_state *zstate) {
+  prefetch_free(zstate->pf);
+  zstate->pf = NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Select the dictionary from the registry (on the R thread) before the 
+// first frame is decompressed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_select_dict(zstd_state *zstate) {
+  if (!zstate->select_dict) return;
+  
+  zstdfile_fill(zstate);
+  if (zstate->compressed_len > 0) {
+    if (zstate->dict != R_NilValue) R_ReleaseObject(zstate->dict);
+    zstate->dict = dctx_select_registered_dict(zstate->dctx, zstate->compressed_data, zstate->compressed_len);
+    if (zstate->dict != R_NilValue) R_PreserveObject(zstate->dict);
+    zstate->select_dict = FALSE;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress up to 'len' bytes into 'dst' on the R thread. 
+// The prefetch worker must not be running.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t zstdfile_decompress_sync(void *dst, size_t len, struct Rconn *rconn) {
+  
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  zstdfile_select_dict(zstate);
+  
+  size_t err = 0;
+  int eof = FALSE;
+  size_t nread = zstdfile_decompress_core(dst, len, rconn, &err, &eof);
+  if (err) {
+    error("zstdfile_decompress() error: %s", ZSTD_getErrorName(err));
+  }
+  if (eof) {
+    rconn->EOF_signalled = TRUE;
+  }
+  
+  zstate->decompressed_total += nread;
+  
+  return nread;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress up to 'len' bytes into 'dst'
+//   - With 'prefetch', data comes from the worker's read-ahead ring.  The 
+//     worker is started on the first read after open() or a seek.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t zstdfile_decompress(void *dst, size_t len, struct Rconn *rconn) {
+  
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  if (zstate->prefetch && zstate->pf == NULL && !rconn->EOF_signalled) {
+    zstdfile_select_dict(zstate);
+    // If the thread can't be started, just decompress on the R thread
+    zstate->pf = prefetch_init(PREFETCH_BLOCKS, OUTSIZE, zstdfile_prefetch_fn, rconn);
+  }
+  
+  if (zstate->pf == NULL) {
+    return zstdfile_decompress_sync(dst, len, rconn);
+  }
+  
+  size_t err = 0;
+  size_t nread = prefetch_read(zstate->pf, dst, len, &err);
+  if (err) {
+    error("zstdfile_decompress() error: %s", ZSTD_getErrorName(err));
+  }
+  if (nread < len) {
+    rconn->EOF_signalled = TRUE;
+  }
+  
+  zstate->decompressed_total += nread;
+  
+  return nread;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// readBin()
+//   - Bytes already decompressed into the readLines() buffer are returned
+//     first, so that mixing readLines(), readBin() and seek() is consistent
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t zstdfile_read(void *dst, size_t size, size_t nitems, struct Rconn *rconn) {
+  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_read(size = %zu, nitems = %zu)\n", size, nitems);
+  
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  size_t len   = size * nitems;
+  size_t avail = zstate->uncompressed_len - zstate->uncompressed_pos;
+  if (avail > len) {
+    avail = len;
+  }
+  
+  memcpy(dst, zstate->uncompressed_data + zstate->uncompressed_pos, avail);
+  zstate->uncompressed_pos += avail;
+  if (avail == len) {
+    return len;
+  }
+  
+  return avail + zstdfile_decompress((unsigned char *)dst + avail, len - avail, rconn);
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // readLines()
 //   - fgetc() called until '\n'. this counts as 1 line.
 //   - when EOF reached, return -1
-//   - Using zstdfile_read() to populate the uncompressed data buffer 
+//   - Using zstdfile_decompress() to populate the uncompressed data buffer 
 //     Rather than attempting to read char-by-char.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 int zstdfile_fgetc(struct Rconn *rconn) {
@@ -416,22 +718,14 @@ int zstdfile_fgetc(struct Rconn *rconn) {
   zstd_state *zstate = (zstd_state *)rconn->private;
   
   if (zstate->uncompressed_pos == zstate->uncompressed_len) {
-    if (zstate->type == TOFILE && feof(zstate->fp)) {
-      // This is where EOF is likely connected. Not in the check below.
-      rconn->EOF_signalled = TRUE;
-      return -1;
-    } 
-    if (zstate->type == TOCONN && zstate->inner->EOF_signalled) {
-      rconn->EOF_signalled = TRUE;
-      return -1;
-    }
-    
-    // Read some data. and reset the state of the 'uncompressed_data' buffer
-    zstate->uncompressed_len = zstdfile_read(zstate->uncompressed_data, 1, zstate->uncompressed_size, rconn);
+    // Read some data. and reset the state of the 'uncompressed_data' buffer.
+    // Note: the end of the compressed input may already have been read 
+    // while decompressed data is still pending, so don't check for EOF
+    // on the file/connection here.  zstdfile_decompress() will return 0 bytes.
+    zstate->uncompressed_len = zstdfile_decompress(zstate->uncompressed_data, zstate->uncompressed_size, rconn);
     zstate->uncompressed_pos = 0;
     
     if (zstate->uncompressed_len == 0) {
-      // This is an unlikely path, but just being really paranoid.
       rconn->EOF_signalled = TRUE;
       return -1;
     }
@@ -442,47 +736,169 @@ int zstdfile_fgetc(struct Rconn *rconn) {
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// writeBin()
+// Current read position in the uncompressed data.
+// Bytes decompressed into the readLines() buffer but not yet consumed 
+// have not been read yet.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-size_t zstdfile_write(const void *src, size_t size, size_t nitems, struct Rconn *rconn) {
-  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_write(size = %zu, nitems = %zu)\n", size, nitems);
+static uint64_t zstdfile_position(zstd_state *zstate) {
+  return zstate->decompressed_total - 
+    (zstate->uncompressed_len - zstate->uncompressed_pos);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Restart decompression at the start of a known frame
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_jump(struct Rconn *rconn, seek_point_t point) {
+  zstd_state *zstate = (zstd_state *)rconn->private;
   
+  zstdfile_prefetch_stop(zstate);
+  if (seek_file(zstate->fp, (long long)point.c_offset, SEEK_SET) < 0) {
+    error("zstdfile_seek(): Couldn't seek in file '%s'", rconn->description);
+  }
+  ZSTD_DCtx_reset(zstate->dctx, ZSTD_reset_session_only);
+  
+  zstate->compressed_offset  = point.c_offset;
+  zstate->compressed_pos     = 0;
+  zstate->compressed_len     = 0;
+  zstate->uncompressed_pos   = 0;
+  zstate->uncompressed_len   = 0;
+  zstate->decompressed_total = point.d_offset;
+  zstate->produced_total     = point.d_offset;
+  rconn->EOF_signalled       = FALSE;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress and discard 'n' bytes (or until the end of the data).
+// Used by seek(), so never starts the prefetch worker.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_skip(struct Rconn *rconn, uint64_t n) {
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  size_t avail = zstate->uncompressed_len - zstate->uncompressed_pos;
+  if (n <= avail) {
+    zstate->uncompressed_pos += n;
+    return;
+  }
+  n -= avail;
+  zstate->uncompressed_pos = 0;
+  zstate->uncompressed_len = 0;
+  
+  while (n > 0) {
+    size_t len = n < zstate->uncompressed_size ? (size_t)n : zstate->uncompressed_size;
+    size_t nread = zstdfile_decompress_sync(zstate->uncompressed_data, len, rconn);
+    if (nread == 0) break;
+    n -= nread;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Move the read position to 'target' bytes into the uncompressed data.
+//
+// Decompression restarts from the nearest known frame start before the 
+// target, unless reading forward from the current position is closer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void zstdfile_seek_to(struct Rconn *rconn, uint64_t target) {
   zstd_state *zstate = (zstd_state *)rconn->private;
   
-  size_t len = size * nitems;
+  uint64_t pos = zstdfile_position(zstate);
+  seek_point_t point = *seek_index_find(&zstate->index, target);
   
-  static unsigned char zstd_raw[OUTSIZE];
+  // After stopping the prefetch worker, the file state is ahead of the
+  // read position, and decompression must restart from a known frame
+  int ahead = zstate->produced_total != zstate->decompressed_total;
+  
+  if (target < pos || point.d_offset > pos || ahead) {
+    zstdfile_jump(rconn, point);
+    pos = point.d_offset;
+  }
+  
+  zstdfile_skip(rconn, target - pos);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// seek()
+//   - Only supported when reading from a file
+//   - 'origin' is 1 = start, 2 = current, 3 = end. 'rw' is ignored.
+//   - Returns the position before any move. 'where = NA' only returns
+//     the position.
+//
+// If the file was written in the seekable format, the seek table is used 
+// to jump directly to the frame containing the target.  
+// Otherwise the start of each frame is recorded as it is decompressed, so 
+// repeated seeks only decompress from the nearest frame start.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double zstdfile_seek(struct Rconn *rconn, double where, int origin, int rw) {
+  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_seek(where = %f, origin = %i)\n", where, origin);
+  
+  if (!rconn->canseek) {
+    error("zstdfile_seek(): only supported when reading from a file");
+  }
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  uint64_t pos = zstdfile_position(zstate);
+  if (ISNA(where)) {
+    return (double)pos;
+  }
+  
+  // The worker adds to the index as it decompresses.  Stop it first.
+  zstdfile_prefetch_stop(zstate);
+  
+  double target;
+  if (origin == 2) {
+    target = (double)pos + where;
+  } else if (origin == 3) {
+    // Need the uncompressed size. If not in the index, read to the end.
+    seek_index_t *index = &zstate->index;
+    if (index->complete) {
+      target = (double)index->points[index->n - 1].d_offset + where;
+    } else {
+      zstdfile_seek_to(rconn, UINT64_MAX);
+      target = (double)zstdfile_position(zstate) + where;
+    }
+  } else {
+    target = where;
+  }
+  
+  if (target < 0) {
+    error("zstdfile_seek(): cannot seek before the start of the data");
+  }
+  
+  zstdfile_seek_to(rconn, (uint64_t)target);
+  
+  return (double)pos;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Buffer and compress 'len' bytes
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t zstdfile_write_data(const void *src, size_t len, zstd_state *zstate) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Background compression. Only a memcpy() here unless the worker has 
+  // fallen behind
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (zstate->aw != NULL) {
+    size_t res = async_writer_write(zstate->aw, src, len);
+    if (ZSTD_isError(res)) {
+      error("zstdfile_write(): error %s\n", ZSTD_getErrorName(res));
+    }
+    return len;
+  }
   
   if (zstate->uncompressed_pos + (size_t)len >= zstate->uncompressed_size) {
     
-    // Compress current serialize buffer 
-    ZSTD_inBuffer input = {
-      .src  = zstate->uncompressed_data, 
-      .size = zstate->uncompressed_pos, 
-      .pos  = 0
-    };
-    
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    // Compress the input data
+    // Compress current buffer
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    do {
-      ZSTD_outBuffer output = { 
-        .dst  = zstd_raw, 
-        .size = OUTSIZE, 
-        .pos  = 0 
-      };
-      
-      size_t rem = ZSTD_compressStream2(zstate->cctx, &output, &input, ZSTD_e_continue);
-      if (ZSTD_isError(rem)) {
-        Rprintf("zstdfile_write(): error %s\n", ZSTD_getErrorName(rem));
-      }
-      
-      if (zstate->type == TOFILE) {
-        fwrite(output.dst, 1, output.pos, zstate->fp);
-      } else {
-        R_WriteConnection(zstate->inner, output.dst, output.pos);
-      }
-    } while (input.pos != input.size);
+    size_t res = seekable_writer_compress(&zstate->writer, zstate->uncompressed_data, zstate->uncompressed_pos);
+    if (ZSTD_isError(res)) {
+      error("zstdfile_write(): error %s\n", ZSTD_getErrorName(res));
+    }
     
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // Reset the uncompressed buffer
@@ -495,31 +911,10 @@ size_t zstdfile_write(const void *src, size_t size, size_t nitems, struct Rconn
     // If larger than zstate->uncompssed_size, then compress directly and return
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     if (len >= zstate->uncompressed_size) {
-      ZSTD_inBuffer input = {
-        .src  = src, 
-        .size = len, 
-        .pos  = 0
-      };
-      
-      do {
-        ZSTD_outBuffer output = { 
-          .dst  = zstd_raw, 
-          .size = OUTSIZE, 
-          .pos  = 0 
-        };
-        
-        size_t rem = ZSTD_compressStream2(zstate->cctx, &output, &input, ZSTD_e_continue);
-        if (ZSTD_isError(rem)) {
-          Rprintf("zstdfile_write(): error %s\n", ZSTD_getErrorName(rem));
-        }
-        
-        if (zstate->type == TOFILE) {
-          fwrite(output.dst, 1, output.pos, zstate->fp);
-        } else {
-          R_WriteConnection(zstate->inner, output.dst, output.pos);
-        }
-      } while (input.pos != input.size);
-      
+      res = seekable_writer_compress(&zstate->writer, src, len);
+      if (ZSTD_isError(res)) {
+        error("zstdfile_write(): error %s\n", ZSTD_getErrorName(res));
+      }
       return len;
     }
   }
@@ -531,6 +926,27 @@ size_t zstdfile_write(const void *src, size_t size, size_t nitems, struct Rconn
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// writeBin()
+//   - Flushes after the write if 'flush_bytes' or 'flush_interval' is reached
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t zstdfile_write(const void *src, size_t size, size_t nitems, struct Rconn *rconn) {
+  if (DEBUG_ZSTDFILE) Rprintf("zstdfile_write(size = %zu, nitems = %zu)\n", size, nitems);
+  
+  zstd_state *zstate = (zstd_state *)rconn->private;
+  
+  size_t len = zstdfile_write_data(src, size * nitems, zstate);
+  
+  zstate->unflushed += (double)len;
+  if ((zstate->flush_bytes    > 0 && zstate->unflushed >= zstate->flush_bytes) ||
+      (zstate->flush_interval > 0 && monotonic_seconds() - zstate->last_flush >= zstate->flush_interval)) {
+    zstdfile_flush_writer(zstate);
+  }
+  
+  return len;
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // writeLines
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -597,10 +1013,56 @@ int zstdfile_vfprintf(struct Rconn *rconn, const char* fmt, va_list ap) {
   
   
   
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find a logical option (e.g. 'async', 'prefetch') in the list of user options.
+// The background threads can't call the R API, so the caller only
+// honours these when reading/writing a file (not an R connection).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int zstdfile_bool_opt(SEXP opts_, const char *name) {
+  if (length(opts_) == 0) return FALSE;
+  
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (isNull(nms_)) return FALSE;
+  
+  for (int i = 0; i < length(opts_); i++) {
+    if (strcmp(CHAR(STRING_ELT(nms_, i)), name) == 0) {
+      return asLogical(VECTOR_ELT(opts_, i)) == TRUE;
+    }
+  }
+  
+  return FALSE;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find a non-negative numeric option (e.g. 'flush_bytes') in the list of 
+// user options.
+// @return value of option, or 0 if not set
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static double zstdfile_num_opt(SEXP opts_, const char *name) {
+  if (length(opts_) == 0) return 0;
+  
+  SEXP nms_ = getAttrib(opts_, R_NamesSymbol);
+  if (isNull(nms_)) return 0;
+  
+  for (int i = 0; i < length(opts_); i++) {
+    if (strcmp(CHAR(STRING_ELT(nms_, i)), name) == 0) {
+      double val = asReal(VECTOR_ELT(opts_, i));
+      if (ISNAN(val) || val < 0) {
+        error("'%s' must be a non-negative number", name);
+      }
+      return val;
+    }
+  }
+  
+  return 0;
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Initialize a zstdfile() R connection object to return to the user
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_) {
+SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_, SEXP index_) {
   
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -623,6 +1085,24 @@ SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_
     }
   }
   
+  zstate->frame_size     = seekable_frame_size_opt(opts_);
+  zstate->async          = zstdfile_bool_opt(opts_, "async");
+  zstate->prefetch       = zstdfile_bool_opt(opts_, "prefetch");
+  zstate->flush_bytes    = zstdfile_num_opt(opts_, "flush_bytes");
+  zstate->flush_interval = zstdfile_num_opt(opts_, "flush_interval");
+  if (zstate->async && zstate->type == TOCONN) {
+    warning("zstdfile(): 'async' is only supported when writing to a file. Ignored.");
+    zstate->async = FALSE;
+  }
+  if (zstate->prefetch && zstate->type == TOCONN) {
+    warning("zstdfile(): 'prefetch' is only supported when reading from a file. Ignored.");
+    zstate->prefetch = FALSE;
+  }
+  
+  if (!isNull(index_)) {
+    zstate->index_file = strdup(CHAR(STRING_ELT(index_, 0)));
+  }
+  
   // Compession/Decompression context
   if (isNull(cctx_)) {
     zstate->cctx = init_cctx_with_opts(opts_, 0, 1);
@@ -631,12 +1111,18 @@ SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_
     zstate->cctx = external_ptr_to_zstd_cctx(cctx_);
   }
   
+  zstate->use_registry = use_dict_registry(dctx_, opts_);
+  zstate->dict = R_NilValue;
+  
   if (isNull(dctx_)) {
     zstate->dctx = init_dctx_with_opts(opts_, 0, 1);
   } else {
     zstate->user_dctx = TRUE;
     zstate->dctx = external_ptr_to_zstd_dctx(dctx_);
+    dctx_unset_stable_buffers(zstate->dctx);
   }
+  zstate->opts = opts_;
+  R_PreserveObject(zstate->opts);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // R will alloc for 'con' within R_new_custom_connection() and then
@@ -650,7 +1136,7 @@ SEXP zstdfile_(SEXP description_, SEXP mode_, SEXP opts_, SEXP cctx_, SEXP dctx_
   con->text       = FALSE; // binary connection by default
   con->canread    =  TRUE; // read-only for now
   con->canwrite   =  TRUE; // read-only for now
-  con->canseek    = FALSE; // not possible in this implementation
+  con->canseek    = FALSE; // set in open() when reading from a file
   con->blocking   =  TRUE; // blacking IO
   con->isGzcon    = FALSE; // Not a gzcon
   